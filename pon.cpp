@@ -1,12 +1,52 @@
+#include "llvm/CallingConv.h"
 #include "llvm/DerivedTypes.h"
+#include "llvm/GVMaterializer.h"
 #include "llvm/LLVMContext.h"
+#include "llvm/Linker.h"
 #include "llvm/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/Analysis/Passes.h"
 #include "llvm/Analysis/Verifier.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JIT.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/IRBuilder.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <cerrno>
+#include <cfloat>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
 #include <string>
-#include <map>
+#include <deque>
 #include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PON_X86_SIMD 1
+#endif
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
 using namespace llvm;
 
 enum Token {
@@ -14,439 +54,3889 @@ enum Token {
   tok_def = -2,
   tok_extern = -3,
   tok_identifier = -4,
-  tok_number = -5
+  tok_number = -5,
+  tok_error = -6
 };
 
-static std::string IdentifierStr;
-static double NumVal;
+class SourceBuffer {
+  char *Block;
+  const char *Base;
+  void *Map;
+  size_t MapSize;
+  int FD;
+  size_t Consumed;
+public:
+  static const size_t BlockSize = 64 * 1024;
+
+  const char *Cur, *End;
+
+  SourceBuffer()
+    : Block(0), Base(0), Map(0), MapSize(0), FD(-1), Consumed(0), Cur(0), End(0) {}
+  ~SourceBuffer() {
+    if (Map) munmap(Map, MapSize);
+    if (FD > 0) close(FD);
+    delete[] Block;
+  }
+
+  bool openFile(const char *Path) {
+    FD = open(Path, O_RDONLY);
+    if (FD < 0) return false;
+
+    struct stat St;
+    if (fstat(FD, &St) != 0) return false;
+
+    MapSize = St.st_size;
+    if (MapSize != 0) {
+      Map = mmap(0, MapSize, PROT_READ, MAP_PRIVATE, FD, 0);
+      if (Map == MAP_FAILED) {
+        Map = 0;
+        return false;
+      }
+      madvise(Map, MapSize, MADV_SEQUENTIAL);
+    }
+
+    Base = Cur = (const char*)Map;
+    End = Cur + MapSize;
+    return true;
+  }
+
+  void openMemory(const char *Data, size_t Size) {
+    Base = Cur = Data;
+    End = Data + Size;
+  }
+
+  void openStdin() {
+    FD = 0;
+    Block = new char[BlockSize];
+    Cur = End = Block;
+  }
+
+  bool fill() {
+    if (!Block) return false;
+
+    Consumed += End - Block;
+    ssize_t N;
+    do N = read(FD, Block, BlockSize);
+    while (N < 0 && errno == EINTR);
+
+    Cur = Block;
+    End = Block + (N > 0 ? N : 0);
+    return N > 0;
+  }
+
+  // The start of the whole input, or null when reading stdin in blocks.
+  const char *data() const { return Block ? 0 : Base; }
+
+  bool rewind() {
+    if (Block) return false;
+    Cur = Base;
+    return true;
+  }
+
+  size_t bytesConsumed() const {
+    return Block ? Consumed + (Cur - Block) : Cur - Base;
+  }
+};
+
+inline bool IsSpace(char C) { return isspace((unsigned char)C); }
+inline bool IsAlpha(char C) { return isalpha((unsigned char)C); }
+inline bool IsAlnum(char C) { return isalnum((unsigned char)C); }
+inline bool IsDigit(char C) { return isdigit((unsigned char)C); }
+inline bool IsNumChar(char C) { return IsDigit(C) || C == '.'; }
+inline bool IsLineChar(char C) { return C != '\n' && C != '\r'; }
+
+typedef const char *(*ScanFn)(const char *P, const char *E);
+
+struct Scanner {
+  const char *Name;
+  ScanFn SkipSpace, SkipAlnum, SkipNumber, SkipLine;
+};
+
+template <bool (*Pred)(char)>
+static const char *ScanScalar(const char *P, const char *E) {
+  while (P != E && Pred(*P))
+    ++P;
+  return P;
+}
+
+static const Scanner ScalarScanner = {
+  "scalar",
+  ScanScalar<IsSpace>, ScanScalar<IsAlnum>,
+  ScanScalar<IsNumChar>, ScanScalar<IsLineChar>
+};
+
+#ifdef PON_X86_SIMD
+// The classifiers are template arguments, so they need external linkage.
+// Each classifier returns 0xff in every byte lane that belongs to the
+// class; the scan loops stop at the first lane that does not.
+#define PON_DEFINE_SIMD_SCANNER(ATTR, VEC, W, LOAD, SET1, SUB, MIN, OR, EQ,  \
+                                MOVEMASK, ALLSET)                              \
+  ATTR static inline VEC InRange##W(VEC X, char Lo, char Hi) {                 \
+    VEC T = SUB(X, SET1(Lo));                                                  \
+    return EQ(MIN(T, SET1(Hi - Lo)), T);                                       \
+  }                                                                            \
+  ATTR inline VEC ClassSpace##W(VEC X) {                                       \
+    return OR(EQ(X, SET1(' ')), InRange##W(X, '\t', '\r'));                    \
+  }                                                                            \
+  ATTR inline VEC ClassAlnum##W(VEC X) {                                       \
+    return OR(InRange##W(X, '0', '9'), InRange##W(OR(X, SET1(0x20)), 'a', 'z')); \
+  }                                                                            \
+  ATTR inline VEC ClassNumber##W(VEC X) {                                      \
+    return OR(InRange##W(X, '0', '9'), EQ(X, SET1('.')));                      \
+  }                                                                            \
+  ATTR inline VEC ClassLine##W(VEC X) {                                        \
+    VEC NL = OR(EQ(X, SET1('\n')), EQ(X, SET1('\r')));                         \
+    return EQ(NL, SET1(0));                                                    \
+  }                                                                            \
+  template <VEC (*Class)(VEC), bool (*Pred)(char)>                             \
+  ATTR static const char *Scan##W(const char *P, const char *E) {              \
+    while (E - P >= W) {                                                       \
+      unsigned Mask = MOVEMASK(Class(LOAD((const VEC*)P)));                    \
+      if (Mask != ALLSET)                                                      \
+        return P + __builtin_ctz(~Mask);                                       \
+      P += W;                                                                  \
+    }                                                                          \
+    return ScanScalar<Pred>(P, E);                                             \
+  }
+
+PON_DEFINE_SIMD_SCANNER(, __m128i, 16, _mm_loadu_si128, _mm_set1_epi8,
+                        _mm_sub_epi8, _mm_min_epu8, _mm_or_si128, _mm_cmpeq_epi8,
+                        (unsigned)_mm_movemask_epi8, 0xffffu)
+PON_DEFINE_SIMD_SCANNER(__attribute__((target("avx2"))), __m256i, 32,
+                        _mm256_loadu_si256, _mm256_set1_epi8, _mm256_sub_epi8,
+                        _mm256_min_epu8, _mm256_or_si256, _mm256_cmpeq_epi8,
+                        (unsigned)_mm256_movemask_epi8, 0xffffffffu)
+#undef PON_DEFINE_SIMD_SCANNER
+
+static const Scanner SSE2Scanner = {
+  "sse2",
+  Scan16<ClassSpace16, IsSpace>, Scan16<ClassAlnum16, IsAlnum>,
+  Scan16<ClassNumber16, IsNumChar>, Scan16<ClassLine16, IsLineChar>
+};
+
+static const Scanner AVX2Scanner = {
+  "avx2",
+  Scan32<ClassSpace32, IsSpace>, Scan32<ClassAlnum32, IsAlnum>,
+  Scan32<ClassNumber32, IsNumChar>, Scan32<ClassLine32, IsLineChar>
+};
+#endif
+
+static const Scanner *BestScanner() {
+#ifdef PON_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return &AVX2Scanner;
+  if (__builtin_cpu_supports("sse2")) return &SSE2Scanner;
+#endif
+  return &ScalarScanner;
+}
+
+static const Scanner *DefaultScanner = &ScalarScanner;
+
+typedef unsigned Symbol;
+
+class SymbolTable {
+  std::deque<std::string> Names;
+  std::vector<unsigned> Hashes;
+  std::vector<Symbol> Buckets;
+  mutable pthread_mutex_t Lock;
+
+  void grow() {
+    std::vector<Symbol> NewBuckets(Buckets.empty() ? 1024 : Buckets.size() * 2, ~0u);
+    unsigned Mask = NewBuckets.size() - 1;
+    for (Symbol S = 0, e = Names.size(); S != e; ++S) {
+      unsigned B = Hashes[S] & Mask;
+      while (NewBuckets[B] != ~0u)
+        B = (B + 1) & Mask;
+      NewBuckets[B] = S;
+    }
+    Buckets.swap(NewBuckets);
+  }
+
+  Symbol internLocked(const char *Str, size_t Len, unsigned H) {
+    if ((Names.size() + 1) * 2 > Buckets.size())
+      grow();
+
+    unsigned Mask = Buckets.size() - 1;
+    for (unsigned B = H & Mask; ; B = (B + 1) & Mask) {
+      Symbol S = Buckets[B];
+      if (S == ~0u) {
+        S = Buckets[B] = Names.size();
+        Names.push_back(std::string(Str, Len));
+        Hashes.push_back(H);
+        return S;
+      }
+      if (Hashes[S] == H && Names[S].size() == Len &&
+          !memcmp(Names[S].data(), Str, Len))
+        return S;
+    }
+  }
+
+public:
+  SymbolTable() { pthread_mutex_init(&Lock, 0); }
+  ~SymbolTable() { pthread_mutex_destroy(&Lock); }
+
+  static unsigned hash(const char *Str, size_t Len) {
+    unsigned H = 2166136261u;
+    for (size_t i = 0; i != Len; ++i)
+      H = (H ^ (unsigned char)Str[i]) * 16777619u;
+    return H;
+  }
+
+  // Names never move once interned, so the returned string may be read
+  // without holding the lock.
+  Symbol intern(const char *Str, size_t Len, unsigned H,
+                const std::string **Name = 0) {
+    pthread_mutex_lock(&Lock);
+    Symbol S = internLocked(Str, Len, H);
+    if (Name) *Name = &Names[S];
+    pthread_mutex_unlock(&Lock);
+    return S;
+  }
+
+  Symbol intern(const char *Str, size_t Len) {
+    return intern(Str, Len, hash(Str, Len));
+  }
+  Symbol intern(const char *Str) { return intern(Str, strlen(Str)); }
+
+  const std::string &name(Symbol S) const {
+    pthread_mutex_lock(&Lock);
+    const std::string &Name = Names[S];
+    pthread_mutex_unlock(&Lock);
+    return Name;
+  }
+
+  unsigned size() const {
+    pthread_mutex_lock(&Lock);
+    unsigned N = Names.size();
+    pthread_mutex_unlock(&Lock);
+    return N;
+  }
+};
+
+static SymbolTable Symbols;
+static const Symbol SymDef = Symbols.intern("def");
+static const Symbol SymExtern = Symbols.intern("extern");
+static const Symbol SymAnon = Symbols.intern("");
+
+static const double PowersOf10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Converts a run of digits and '.' to the nearest double. Literals with at
+// most 19 significant digits whose mantissa fits in 53 bits and whose scale
+// is within 10^22 are exact with a single IEEE multiply or divide
+// (Clinger's fast path); anything else falls back to strtod. Returns false
+// if the run has no digits or more than one '.'.
+static bool ParseNumber(const char *P, const char *E, double &Val) {
+  const char *Begin = P;
+  unsigned long long Mantissa = 0;
+  int SigDigits = 0, Exp10 = 0;
+  bool SeenDot = false, AnyDigit = false, Truncated = false;
+
+  for (; P != E; ++P) {
+    if (*P == '.') {
+      if (SeenDot) return false;
+      SeenDot = true;
+      continue;
+    }
+
+    unsigned D = *P - '0';
+    AnyDigit = true;
+    if (SigDigits == 0 && D == 0) {
+      if (SeenDot) --Exp10;
+    } else if (SigDigits < 19) {
+      Mantissa = Mantissa * 10 + D;
+      ++SigDigits;
+      if (SeenDot) --Exp10;
+    } else {
+      Truncated = true;
+      if (!SeenDot) ++Exp10;
+    }
+  }
+
+  if (!AnyDigit) return false;
+
+#if FLT_EVAL_METHOD == 0
+  if (!Truncated && Mantissa <= (1ULL << 53) && Exp10 >= -22 && Exp10 <= 22) {
+    double M = (double)Mantissa;
+    Val = Exp10 < 0 ? M / PowersOf10[-Exp10] : M * PowersOf10[Exp10];
+    return true;
+  }
+#endif
+
+  std::string Str(Begin, E);
+  Val = strtod(Str.c_str(), 0);
+  return true;
+}
+
+class Lexer {
+  struct CacheEntry {
+    unsigned Hash;
+    Symbol Sym;
+    const std::string *Name;
+  };
+  static const unsigned CacheSize = 512;
+
+  SourceBuffer &Src;
+  const Scanner *Scan;
+  std::string Scratch;
+  CacheEntry Cache[CacheSize];
+  Symbol IdentifierSym;
+  double NumVal;
+  size_t TokOffset;
+
+  void lexRun(ScanFn Skip, const char *&TokStart, const char *&TokEnd);
+  Symbol intern(const char *Str, size_t Len);
+
+public:
+  Lexer(SourceBuffer &src, const Scanner *scan = DefaultScanner)
+    : Src(src), Scan(scan), IdentifierSym(0), NumVal(0), TokOffset(0) {
+    memset(Cache, 0, sizeof(Cache));
+  }
+
+  int gettok();
+
+  Symbol getIdentifier() const { return IdentifierSym; }
+  double getNumber() const { return NumVal; }
+  size_t getTokenOffset() const { return TokOffset; }
+  SourceBuffer &getSource() { return Src; }
+  const Scanner *getScanner() const { return Scan; }
+};
+
+void Lexer::lexRun(ScanFn Skip, const char *&TokStart, const char *&TokEnd) {
+  TokStart = Src.Cur;
+  Src.Cur = Skip(Src.Cur, Src.End);
+  TokEnd = Src.Cur;
+  if (Src.Cur != Src.End) return;
+
+  Scratch.assign(TokStart, TokEnd);
+  while (Src.fill()) {
+    const char *Start = Src.Cur;
+    Src.Cur = Skip(Src.Cur, Src.End);
+    Scratch.append(Start, Src.Cur);
+    if (Src.Cur != Src.End) break;
+  }
+  TokStart = Scratch.data();
+  TokEnd = TokStart + Scratch.size();
+}
+
+Symbol Lexer::intern(const char *Str, size_t Len) {
+  unsigned H = SymbolTable::hash(Str, Len);
+  CacheEntry &E = Cache[H % CacheSize];
+  if (E.Name && E.Hash == H && E.Name->size() == Len &&
+      !memcmp(E.Name->data(), Str, Len))
+    return E.Sym;
+
+  E.Hash = H;
+  E.Sym = Symbols.intern(Str, Len, H, &E.Name);
+  return E.Sym;
+}
+
+int Lexer::gettok() {
+  char C;
+  while (1) {
+    Src.Cur = Scan->SkipSpace(Src.Cur, Src.End);
+    if (Src.Cur == Src.End) {
+      if (!Src.fill()) {
+        TokOffset = Src.bytesConsumed();
+        return tok_eof;
+      }
+      continue;
+    }
+
+    C = *Src.Cur;
+    if (C != '#') break;
+
+    while (1) {
+      Src.Cur = Scan->SkipLine(Src.Cur, Src.End);
+      if (Src.Cur != Src.End || !Src.fill()) break;
+    }
+  }
+
+  TokOffset = Src.bytesConsumed();
+
+  if (IsAlpha(C)) {
+    const char *TokStart, *TokEnd;
+    lexRun(Scan->SkipAlnum, TokStart, TokEnd);
+    IdentifierSym = intern(TokStart, TokEnd - TokStart);
+
+    if (IdentifierSym == SymDef) return tok_def;
+    if (IdentifierSym == SymExtern) return tok_extern;
+    return tok_identifier;
+  }
+
+  if (IsDigit(C) || C == '.') {
+    const char *TokStart, *TokEnd;
+    lexRun(Scan->SkipNumber, TokStart, TokEnd);
+
+    if (!ParseNumber(TokStart, TokEnd, NumVal))
+      return tok_error;
+    return tok_number;
+  }
+
+  ++Src.Cur;
+  return (unsigned char)C;
+}
+
+static double Now() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+}
+
+// A whole source lexed up front into parallel arrays. Values holds the
+// Symbol of identifiers and keywords, or an index into Literals for
+// numbers. The stream always ends with tok_eof.
+class TokenStream {
+public:
+  std::vector<short> Kinds;
+  std::vector<unsigned> Offsets;
+  std::vector<unsigned> Values;
+  std::vector<double> Literals;
+
+  void lex(Lexer &Lex) {
+    int Tok;
+    do {
+      Tok = Lex.gettok();
+      unsigned Value = 0;
+      if (Tok == tok_identifier || Tok == tok_def || Tok == tok_extern) {
+        Value = Lex.getIdentifier();
+      } else if (Tok == tok_number) {
+        Value = Literals.size();
+        Literals.push_back(Lex.getNumber());
+      }
+      Kinds.push_back(Tok);
+      Offsets.push_back(Lex.getTokenOffset());
+      Values.push_back(Value);
+    } while (Tok != tok_eof);
+  }
+
+  unsigned size() const { return Kinds.size(); }
+
+  size_t bytes() const {
+    return Kinds.size() * (sizeof(short) + 2 * sizeof(unsigned)) +
+           Literals.size() * sizeof(double);
+  }
+};
+
+static double LexAll(Lexer &Lex, unsigned long &Tokens) {
+  double Start = Now();
+  Tokens = 0;
+  while (Lex.gettok() != tok_eof)
+    ++Tokens;
+  return Now() - Start;
+}
+
+static void ReportLex(Lexer &Lex, unsigned long Tokens, double Elapsed) {
+  double MB = Lex.getSource().bytesConsumed() / (1024.0 * 1024.0);
+  fprintf(stderr, "%s: lexed %lu tokens, %.2f MB in %.3f s (%.1f MB/s)\n",
+          Lex.getScanner()->Name, Tokens, MB, Elapsed,
+          Elapsed > 0 ? MB / Elapsed : 0.0);
+}
+
+static void LexOnly(SourceBuffer &Src) {
+  Lexer Lex(Src);
+  unsigned long Tokens;
+  double Elapsed = LexAll(Lex, Tokens);
+  ReportLex(Lex, Tokens, Elapsed);
+}
+
+static bool BenchLex(SourceBuffer &Src) {
+  const Scanner *Scanners[] = {
+    &ScalarScanner,
+#ifdef PON_X86_SIMD
+    &SSE2Scanner,
+    __builtin_cpu_supports("avx2") ? &AVX2Scanner : 0,
+#endif
+  };
+
+  for (unsigned i = 0; i != sizeof(Scanners) / sizeof(Scanners[0]); ++i) {
+    if (!Scanners[i]) continue;
+    if (!Src.rewind())
+      return false;
+
+    Lexer Lex(Src, Scanners[i]);
+    unsigned long Tokens;
+    double Best = LexAll(Lex, Tokens);
+    for (unsigned Run = 1; Run != 5; ++Run) {
+      Src.rewind();
+      double Elapsed = LexAll(Lex, Tokens);
+      if (Elapsed < Best) Best = Elapsed;
+    }
+    ReportLex(Lex, Tokens, Best);
+  }
+  return true;
+}
+
+static bool BenchNumbers(SourceBuffer &Src) {
+  if (!Src.rewind())
+    return false;
+
+  std::vector<std::pair<const char*, const char*> > Literals;
+  const char *P = Src.Cur, *E = Src.End;
+  while (P != E) {
+    if (IsAlpha(*P)) {
+      P = DefaultScanner->SkipAlnum(P, E);
+    } else if (IsNumChar(*P)) {
+      const char *Start = P;
+      P = DefaultScanner->SkipNumber(P, E);
+      Literals.push_back(std::make_pair(Start, P));
+    } else {
+      ++P;
+    }
+  }
+
+  double Sum = 0;
+  double Start = Now();
+  for (unsigned i = 0, e = Literals.size(); i != e; ++i) {
+    std::string NumStr(Literals[i].first, Literals[i].second);
+    Sum += strtod(NumStr.c_str(), 0);
+  }
+  double StrtodTime = Now() - Start;
+
+  unsigned Malformed = 0, Mismatches = 0;
+  Start = Now();
+  for (unsigned i = 0, e = Literals.size(); i != e; ++i) {
+    double Val;
+    if (ParseNumber(Literals[i].first, Literals[i].second, Val))
+      Sum -= Val;
+    else
+      ++Malformed;
+  }
+  double FastTime = Now() - Start;
+
+  for (unsigned i = 0, e = Literals.size(); i != e; ++i) {
+    double Val;
+    std::string NumStr(Literals[i].first, Literals[i].second);
+    if (ParseNumber(Literals[i].first, Literals[i].second, Val) &&
+        Val != strtod(NumStr.c_str(), 0))
+      ++Mismatches;
+  }
+
+  fprintf(stderr, "%lu literals: strtod %.3f s, ParseNumber %.3f s (%.1fx), "
+          "%u malformed, %u mismatches (checksum %g)\n",
+          (unsigned long)Literals.size(), StrtodTime, FastTime,
+          FastTime > 0 ? StrtodTime / FastTime : 0.0, Malformed, Mismatches,
+          Sum);
+  return true;
+}
+
+class Arena {
+  std::vector<char*> Slabs;
+  char *Cur, *End;
+  size_t Used;
+
+  Arena(const Arena &);
+  void operator=(const Arena &);
+
+public:
+  static const size_t SlabSize = 16 * 1024;
+  static const size_t Align = 8;
+
+  Arena() : Cur(0), End(0), Used(0) {}
+  ~Arena() {
+    for (unsigned i = 0, e = Slabs.size(); i != e; ++i)
+      free(Slabs[i]);
+  }
+
+  void *allocate(size_t Size) {
+    Size = (Size + Align - 1) & ~(Align - 1);
+    Used += Size;
+    if ((size_t)(End - Cur) < Size) {
+      size_t Bytes = Size > SlabSize ? Size : SlabSize;
+      Cur = (char*)malloc(Bytes);
+      End = Cur + Bytes;
+      Slabs.push_back(Cur);
+    }
+    void *P = Cur;
+    Cur += Size;
+    return P;
+  }
+
+  // Drops everything allocated so far. The first slab is kept for reuse;
+  // nothing allocated here has its destructor run.
+  void reset() {
+    for (unsigned i = 1, e = Slabs.size(); i < e; ++i)
+      free(Slabs[i]);
+    if (!Slabs.empty()) {
+      Slabs.resize(1);
+      Cur = Slabs[0];
+      End = Cur + SlabSize;
+    }
+    Used = 0;
+  }
+
+  size_t bytesUsed() const { return Used; }
+};
+
+inline void *operator new(size_t Size, Arena &A) { return A.allocate(Size); }
+inline void operator delete(void *, Arena &) {}
+
+template <typename T>
+class ArenaArray {
+  T *Data;
+  unsigned Size;
+public:
+  ArenaArray() : Data(0), Size(0) {}
+  ArenaArray(Arena &A, const std::vector<T> &V) : Data(0), Size(V.size()) {
+    if (Size == 0) return;
+    Data = (T*)A.allocate(Size * sizeof(T));
+    std::copy(V.begin(), V.end(), Data);
+  }
+  ArenaArray(Arena &A, const ArenaArray &Other) : Data(0), Size(Other.Size) {
+    if (Size == 0) return;
+    Data = (T*)A.allocate(Size * sizeof(T));
+    std::copy(Other.Data, Other.Data + Size, Data);
+  }
+
+  unsigned size() const { return Size; }
+  const T &operator[](unsigned i) const { return Data[i]; }
+};
+
+enum ExprKind {
+  ExprNumber,
+  ExprVariable,
+  ExprBinary,
+  ExprCall
+};
+
+typedef unsigned ExprRef;
+static const ExprRef NoExpr = ~0u;
+static const unsigned NoSlot = ~0u;
+
+// Number: A indexes Literals. Variable: A is the slot the name resolved to
+// while parsing, or NoSlot, and B is the Symbol. Binary: A and B are
+// the operands. Call: A is the callee Symbol and its NumArgs operands start
+// at Args[B]. Operands always precede their users in the node array.
+struct ExprNode {
+  unsigned char Kind;
+  char Op;
+  unsigned short NumArgs;
+  unsigned A, B;
+};
+
+// Resolves names to the slots of the enclosing function while its body is
+// parsed. Slots form one stack across nested scopes; each binding records
+// the slot it shadows, so popping a scope restores the outer names without
+// copying anything.
+class ScopeTable {
+  std::vector<unsigned> SlotOf;
+  std::vector<Symbol> Names;
+  std::vector<unsigned> Shadowed;
+  std::vector<unsigned> Starts;
+public:
+  void push() { Starts.push_back(Names.size()); }
+
+  void pop() {
+    unsigned Start = Starts.back();
+    Starts.pop_back();
+    while (Names.size() != Start) {
+      SlotOf[Names.back()] = Shadowed.back();
+      Names.pop_back();
+      Shadowed.pop_back();
+    }
+  }
+
+  unsigned bind(Symbol Name) {
+    if (SlotOf.size() <= Name)
+      SlotOf.resize(Name + 1);
+    Shadowed.push_back(SlotOf[Name]);
+    Names.push_back(Name);
+    SlotOf[Name] = Names.size();
+    return Names.size() - 1;
+  }
+
+  unsigned lookup(Symbol Name) const {
+    return Name < SlotOf.size() ? SlotOf[Name] - 1 : NoSlot;
+  }
+};
+
+// With hash-consing on, structurally identical subtrees within one body
+// share a node, so codegen emits them once. Calls are only shared when the
+// user promises that every callee is free of side effects.
+enum HashConsMode { HashConsOff, HashConsPure, HashConsCalls };
+static HashConsMode HashConsing = HashConsOff;
+
+class ExprBuilder {
+  struct Slot {
+    unsigned Gen;
+    ExprRef Ref;
+  };
+  std::vector<Slot> Table;
+  unsigned Gen, Entries;
+  HashConsMode Mode;
+
+  static unsigned mix(unsigned H, unsigned V) {
+    return (H ^ V) * 16777619u;
+  }
+
+  unsigned hashNode(const ExprNode &N, const ExprRef *CallArgs) const {
+    unsigned H = mix(mix(2166136261u, N.Kind), (unsigned char)N.Op);
+    switch (N.Kind) {
+    case ExprNumber: {
+      unsigned W[2];
+      memcpy(W, &Literals[N.A], sizeof(W));
+      return mix(mix(H, W[0]), W[1]);
+    }
+    case ExprCall:
+      H = mix(H, N.A);
+      for (unsigned i = 0; i != N.NumArgs; ++i)
+        H = mix(H, CallArgs[i]);
+      return H;
+    default:
+      return mix(mix(H, N.A), N.B);
+    }
+  }
+
+  bool sameNode(const ExprNode &N, const ExprRef *CallArgs, ExprRef Other) const {
+    const ExprNode &O = Nodes[Other];
+    if (O.Kind != N.Kind || O.Op != N.Op || O.NumArgs != N.NumArgs)
+      return false;
+    switch (N.Kind) {
+    case ExprNumber:
+      return !memcmp(&Literals[N.A], &Literals[O.A], sizeof(double));
+    case ExprCall:
+      return O.A == N.A &&
+             std::equal(CallArgs, CallArgs + N.NumArgs, Args.begin() + O.B);
+    default:
+      return O.A == N.A && O.B == N.B;
+    }
+  }
+
+  // Returns the slot holding an equal node, or the empty slot to put it in.
+  Slot &lookup(const ExprNode &N, const ExprRef *CallArgs) {
+    unsigned Mask = Table.size() - 1;
+    for (unsigned i = hashNode(N, CallArgs) & Mask; ; i = (i + 1) & Mask) {
+      Slot &S = Table[i];
+      if (S.Gen != Gen || sameNode(N, CallArgs, S.Ref))
+        return S;
+    }
+  }
+
+  void grow() {
+    Table.assign(Table.empty() ? 256 : Table.size() * 2, Slot());
+    Gen = 1;
+    for (ExprRef i = 0, e = Nodes.size(); i != e; ++i) {
+      const ExprNode &N = Nodes[i];
+      if (N.Kind == ExprCall && Mode != HashConsCalls)
+        continue;
+      Slot &S = lookup(N, N.Kind == ExprCall ? &Args[N.B] : 0);
+      S.Gen = Gen;
+      S.Ref = i;
+    }
+  }
+
+public:
+  std::vector<ExprNode> Nodes;
+  std::vector<double> Literals;
+  std::vector<ExprRef> Args;
+  unsigned long Shared;
+
+  ExprBuilder() : Gen(0), Entries(0), Mode(HashConsOff), Shared(0) {}
+
+  void clear() {
+    Nodes.clear();
+    Literals.clear();
+    Args.clear();
+    Mode = HashConsing;
+    Entries = 0;
+    if (++Gen == 0)
+      Table.clear();
+  }
+
+  ExprRef add(ExprKind Kind, char Op, unsigned A, unsigned B, unsigned NumArgs = 0) {
+    ExprNode N;
+    N.Kind = Kind;
+    N.Op = Op;
+    N.NumArgs = NumArgs;
+    N.A = A;
+    N.B = B;
+    Nodes.push_back(N);
+    return Nodes.size() - 1;
+  }
+
+  // Adds N unless an equal node already exists. Number and call nodes have
+  // already pushed their literal or arguments, which are dropped on a hit.
+  ExprRef intern(ExprKind Kind, char Op, unsigned A, unsigned B,
+                 unsigned NumArgs = 0) {
+    if (Mode == HashConsOff || (Kind == ExprCall && Mode != HashConsCalls))
+      return add(Kind, Op, A, B, NumArgs);
+
+    if ((Entries + 1) * 2 > Table.size())
+      grow();
+
+    ExprNode N;
+    N.Kind = Kind;
+    N.Op = Op;
+    N.NumArgs = NumArgs;
+    N.A = A;
+    N.B = B;
+    const ExprRef *CallArgs = Kind == ExprCall ? &Args[B] : 0;
+    Slot &S = lookup(N, CallArgs);
+    if (S.Gen == Gen) {
+      if (Kind == ExprNumber) Literals.pop_back();
+      if (Kind == ExprCall) Args.resize(B);
+      ++Shared;
+      return S.Ref;
+    }
+
+    S.Gen = Gen;
+    S.Ref = add(Kind, Op, A, B, NumArgs);
+    ++Entries;
+    return S.Ref;
+  }
+
+  ExprRef number(double Val) {
+    Literals.push_back(Val);
+    return intern(ExprNumber, 0, Literals.size() - 1, 0);
+  }
+  ExprRef variable(unsigned Slot, Symbol Name) {
+    return intern(ExprVariable, 0, Slot, Name);
+  }
+  ExprRef binary(char Op, ExprRef LHS, ExprRef RHS) {
+    return intern(ExprBinary, Op, LHS, RHS);
+  }
+  ExprRef call(Symbol Callee, const std::vector<ExprRef> &CallArgs) {
+    unsigned First = Args.size();
+    Args.insert(Args.end(), CallArgs.begin(), CallArgs.end());
+    return intern(ExprCall, 0, Callee, First, CallArgs.size());
+  }
+};
+
+class ExprAST {
+public:
+  ArenaArray<ExprNode> Nodes;
+  ArenaArray<double> Literals;
+  ArenaArray<ExprRef> Args;
+  ExprRef Root;
+
+  ExprAST(Arena &A, const ExprBuilder &B, ExprRef root)
+    : Nodes(A, B.Nodes), Literals(A, B.Literals), Args(A, B.Args), Root(root) {}
+  ExprAST(Arena &A, const ExprAST &E)
+    : Nodes(A, E.Nodes), Literals(A, E.Literals), Args(A, E.Args), Root(E.Root) {}
+
+  Value *Codegen(const std::vector<Value*> &Slots) const;
+};
+
+class PrototypeAST {
+  Symbol Name;
+  ArenaArray<Symbol> Args;
+public:
+  PrototypeAST(Symbol name, const ArenaArray<Symbol> &args)
+    : Name(name), Args(args) {}
+
+  Symbol getName() const { return Name; }
+  const ArenaArray<Symbol> &getArgs() const { return Args; }
+
+  Function *Codegen();
+};
+
+class FunctionAST {
+  PrototypeAST *Proto;
+  ExprAST *Body;
+public:
+  FunctionAST(PrototypeAST *proto, ExprAST *body)
+    : Proto(proto), Body(body) {}
+
+  PrototypeAST *getProto() const { return Proto; }
+  ExprAST *getBody() const { return Body; }
+  Function *Codegen();
+};
+
+// Indexed by the operator character; NA marks characters that are not
+// binary operators.
+#define NA -1
+static const signed char BinopPrecedence[256] = {
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, 40, 20, NA, 20, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, 10, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,
+  NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA
+};
+#undef NA
+
+class Parser {
+  Lexer *Lex;
+  const TokenStream *Tokens;
+  unsigned TokPos;
+  int CurTok;
+  size_t CurOffset;
+  Symbol IdentifierSym;
+  double NumVal;
+  Arena Nodes;
+  ExprBuilder Build;
+  ScopeTable Scopes;
+  unsigned long Items, ItemNodes;
+  size_t ItemBytes, MaxItemBytes;
+
+  Parser(const Parser &);
+  void operator=(const Parser &);
+
+  enum FrameKind { FrameTop, FrameParen, FrameCall };
+
+  // An open '(' or call argument list. Operators and operands pushed
+  // since it was opened live above OpBase and ValBase.
+  struct Frame {
+    FrameKind Kind;
+    Symbol Callee;
+    unsigned OpBase, ValBase;
+  };
+
+  struct PendingOp {
+    char Op;
+    signed char Prec;
+  };
+
+  std::vector<Frame> Frames;
+  std::vector<PendingOp> Ops;
+  std::vector<ExprRef> Vals;
+
+  int GetTokPrecedence();
+  void pushFrame(FrameKind Kind, Symbol Callee);
+  ExprRef reduceOps(unsigned OpBase, int MinPrec, ExprRef RHS);
+  ExprRef ParseExpression();
+  ExprAST *ParseBody(const ArenaArray<Symbol> &Args);
+  PrototypeAST *ParsePrototype();
+
+public:
+  Parser(Lexer &lex)
+    : Lex(&lex), Tokens(0), TokPos(0), CurTok(0), CurOffset(0),
+      IdentifierSym(0), NumVal(0),
+      Items(0), ItemNodes(0), ItemBytes(0), MaxItemBytes(0) {}
+  Parser(const TokenStream &tokens)
+    : Lex(0), Tokens(&tokens), TokPos(0), CurTok(0), CurOffset(0),
+      IdentifierSym(0), NumVal(0),
+      Items(0), ItemNodes(0), ItemBytes(0), MaxItemBytes(0) {}
+
+  int getCurTok() const { return CurTok; }
+
+  int getNextToken() {
+    if (!Tokens) {
+      CurTok = Lex->gettok();
+      CurOffset = Lex->getTokenOffset();
+      if (CurTok == tok_identifier) IdentifierSym = Lex->getIdentifier();
+      else if (CurTok == tok_number) NumVal = Lex->getNumber();
+      return CurTok;
+    }
+
+    CurTok = Tokens->Kinds[TokPos];
+    CurOffset = Tokens->Offsets[TokPos];
+    if (CurTok == tok_identifier) IdentifierSym = Tokens->Values[TokPos];
+    else if (CurTok == tok_number) NumVal = Tokens->Literals[Tokens->Values[TokPos]];
+    if (CurTok != tok_eof) ++TokPos;
+    return CurTok;
+  }
+
+  FunctionAST *ParseDefinition();
+  FunctionAST *ParseTopLevelExpr();
+  PrototypeAST *ParseExtern();
+
+  const char *getSourceText() const { return Lex ? Lex->getSource().data() : 0; }
+  PrototypeAST *PreParseDefinition(const char *&BodyBegin, const char *&BodyEnd);
+  FunctionAST *ParseDeferredBody(PrototypeAST *Proto);
+
+  // Frees every node of the item parsed since the last call and returns
+  // how many bytes it took.
+  size_t releaseNodes() {
+    size_t Bytes = Nodes.bytesUsed();
+    ++Items;
+    ItemBytes += Bytes;
+    if (Bytes > MaxItemBytes) MaxItemBytes = Bytes;
+    Nodes.reset();
+    return Bytes;
+  }
+
+  void printArenaStats() const {
+    fprintf(stderr, "AST arena: %lu items, %lu bytes total, %.1f bytes/item avg, "
+            "%lu max\n", Items, (unsigned long)ItemBytes,
+            Items ? (double)ItemBytes / Items : 0.0, (unsigned long)MaxItemBytes);
+    fprintf(stderr, "AST nodes: %lu, %u bytes each, %.1f arena bytes/node\n",
+            ItemNodes, (unsigned)sizeof(ExprNode),
+            ItemNodes ? (double)ItemBytes / ItemNodes : 0.0);
+    if (HashConsing != HashConsOff)
+      fprintf(stderr, "Hash-consing: %lu duplicate subtrees shared\n", Build.Shared);
+  }
+};
+
+int Parser::GetTokPrecedence() {
+  if ((unsigned)CurTok > 255)
+    return -1;
+  return BinopPrecedence[CurTok];
+}
+
+// Worker threads point this at a per-item buffer so their messages can be
+// replayed in source order.
+static __thread std::string *ErrorLog = 0;
+
+ExprRef Error(const char *Str) {
+  if (ErrorLog)
+    *ErrorLog += std::string("Error: ") + Str + "\n";
+  else
+    fprintf(stderr, "Error: %s\n", Str);
+  return NoExpr;
+}
+PrototypeAST *ErrorP(const char *Str) { Error(Str); return 0; }
+FunctionAST *ErrorF(const char *Str) { Error(Str); return 0; }
+
+void Parser::pushFrame(FrameKind Kind, Symbol Callee) {
+  Frame F;
+  F.Kind = Kind;
+  F.Callee = Callee;
+  F.OpBase = Ops.size();
+  F.ValBase = Vals.size();
+  Frames.push_back(F);
+}
+
+// Folds pending operators of precedence MinPrec or higher, with RHS as
+// the rightmost operand. Equal precedences fold left to right.
+inline ExprRef Parser::reduceOps(unsigned OpBase, int MinPrec, ExprRef RHS) {
+  while (Ops.size() > OpBase && Ops.back().Prec >= MinPrec) {
+    RHS = Build.binary(Ops.back().Op, Vals.back(), RHS);
+    Vals.pop_back();
+    Ops.pop_back();
+  }
+  return RHS;
+}
+
+// Operator precedence parsing with explicit operator, operand and
+// bracket stacks, so nesting depth is bounded by memory rather than by
+// the C++ stack. The operand just parsed stays in Operand; only operands
+// still waiting on an operator or a closing bracket go on Vals.
+ExprRef Parser::ParseExpression() {
+  Frames.clear();
+  Ops.clear();
+  Vals.clear();
+  pushFrame(FrameTop, 0);
+
+  while (1) {
+    ExprRef Operand;
+
+    switch (CurTok) {
+    default: return Error("unknown token when expecting an expression");
+    case tok_error: return Error("malformed number literal");
+
+    case tok_number:
+      Operand = Build.number(NumVal);
+      getNextToken();
+      break;
+
+    case '(':
+      getNextToken();
+      pushFrame(FrameParen, 0);
+      continue;
+
+    case tok_identifier: {
+      Symbol IdName = IdentifierSym;
+      getNextToken();
+
+      if (CurTok != '(') {
+        Operand = Build.variable(Scopes.lookup(IdName), IdName);
+        break;
+      }
+
+      getNextToken();
+      if (CurTok != ')') {
+        pushFrame(FrameCall, IdName);
+        continue;
+      }
+
+      getNextToken();
+      Operand = Build.call(IdName, std::vector<ExprRef>());
+      break;
+    }
+    }
+
+    // Keep folding until an operator sends us back for the next operand,
+    // or the outermost frame is done.
+    while (1) {
+      int TokPrec = GetTokPrecedence();
+      if (TokPrec >= 0) {
+        Vals.push_back(reduceOps(Frames.back().OpBase, TokPrec, Operand));
+        PendingOp Op = { (char)CurTok, (signed char)TokPrec };
+        Ops.push_back(Op);
+        getNextToken();
+        break;
+      }
+
+      Frame &F = Frames.back();
+      Operand = reduceOps(F.OpBase, 0, Operand);
+
+      if (F.Kind == FrameTop)
+        return Operand;
+
+      if (F.Kind == FrameParen) {
+        if (CurTok != ')')
+          return Error("expected ')'");
+        getNextToken();
+        Frames.pop_back();
+        continue;
+      }
+
+      if (CurTok == ',') {
+        Vals.push_back(Operand);
+        getNextToken();
+        break;
+      }
+      if (CurTok != ')')
+        return Error("Expected ')' or ',' in argument list");
+      getNextToken();
+
+      if (Vals.size() - F.ValBase >= 0xffff)
+        return Error("Too many arguments in call");
+
+      std::vector<ExprRef> Args(Vals.begin() + F.ValBase, Vals.end());
+      Args.push_back(Operand);
+      Vals.resize(F.ValBase);
+      Operand = Build.call(F.Callee, Args);
+      Frames.pop_back();
+    }
+  }
+}
+
+ExprAST *Parser::ParseBody(const ArenaArray<Symbol> &Args) {
+  Build.clear();
+  Scopes.push();
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    Scopes.bind(Args[i]);
+  ExprRef Root = ParseExpression();
+  Scopes.pop();
+  if (Root == NoExpr) return 0;
+
+  ItemNodes += Build.Nodes.size();
+  return new (Nodes) ExprAST(Nodes, Build, Root);
+}
+
+PrototypeAST *Parser::ParsePrototype() {
+  if (CurTok != tok_identifier)
+    return ErrorP("Expected function name in prototype");
+
+  Symbol FnName = IdentifierSym;
+  getNextToken();
+
+  if (CurTok != '(')
+    return ErrorP("Expected '(' in prototype");
+
+  std::vector<Symbol> ArgNames;
+  while (getNextToken() == tok_identifier)
+    ArgNames.push_back(IdentifierSym);
+  if (CurTok != ')')
+    return ErrorP("Expected ')' in prototype");
+
+  getNextToken();
+
+  return new (Nodes) PrototypeAST(FnName, ArenaArray<Symbol>(Nodes, ArgNames));
+}
+
+FunctionAST *Parser::ParseDefinition() {
+  getNextToken();
+  PrototypeAST *Proto = ParsePrototype();
+  if (Proto == 0) return 0;
+
+  if (ExprAST *E = ParseBody(Proto->getArgs()))
+    return new (Nodes) FunctionAST(Proto, E);
+  return 0;
+}
+
+FunctionAST *Parser::ParseTopLevelExpr() {
+  if (ExprAST *E = ParseBody(ArenaArray<Symbol>())) {
+    PrototypeAST *Proto = new (Nodes) PrototypeAST(SymAnon, ArenaArray<Symbol>());
+    return new (Nodes) FunctionAST(Proto, E);
+  }
+  return 0;
+}
+
+PrototypeAST *Parser::ParseExtern() {
+  getNextToken();
+  return ParsePrototype();
+}
+
+// Parses only the prototype of a definition and skips its body, which
+// runs up to the next ';', 'def', 'extern' or end of input. Brackets must
+// balance; everything else is checked when the body is parsed for real.
+PrototypeAST *Parser::PreParseDefinition(const char *&BodyBegin,
+                                         const char *&BodyEnd) {
+  getNextToken();
+  PrototypeAST *Proto = ParsePrototype();
+  if (Proto == 0) return 0;
+
+  // The body ends where ParseExpression would stop: outside brackets,
+  // after an operand, at a token that is neither a binary operator nor
+  // the '(' of a call. Malformed bodies are left to ParseDeferredBody.
+  const char *SourceText = getSourceText();
+  BodyBegin = SourceText + CurOffset;
+  int Depth = 0;
+  bool AfterOperand = false, AfterIdentifier = false;
+  while (CurTok != ';' && CurTok != tok_def && CurTok != tok_extern &&
+         CurTok != tok_eof) {
+    bool Call = CurTok == '(' && AfterIdentifier;
+    if (Depth == 0 && AfterOperand && GetTokPrecedence() < 0 && !Call)
+      break;
+
+    AfterIdentifier = false;
+    if (CurTok == '(') {
+      ++Depth;
+      AfterOperand = false;
+    } else if (CurTok == ')') {
+      if (--Depth < 0)
+        return ErrorP("unbalanced ')' in function body");
+      AfterOperand = true;
+    } else if (CurTok == ',' || GetTokPrecedence() >= 0) {
+      AfterOperand = false;
+    } else if (CurTok == tok_identifier || CurTok == tok_number) {
+      AfterIdentifier = CurTok == tok_identifier;
+      AfterOperand = true;
+    }
+    getNextToken();
+  }
+  if (Depth != 0)
+    return ErrorP("unbalanced '(' in function body");
+
+  BodyEnd = SourceText + CurOffset;
+  return Proto;
+}
+
+FunctionAST *Parser::ParseDeferredBody(PrototypeAST *Proto) {
+  getNextToken();
+  ExprAST *E = ParseBody(Proto->getArgs());
+  if (E == 0) return 0;
+
+  if (CurTok != tok_eof)
+    return ErrorF("unexpected token after function body");
+  return new (Nodes) FunctionAST(Proto, E);
+}
+
+// Codegen state is per thread. Batch compile workers (-batch) point these
+// at a context and module of their own; every other thread shares the
+// main thread's, which is where the JIT lives.
+static __thread Module *TheModule;
+static __thread ExecutionEngine *TheExecutionEngine;
+static __thread FunctionPassManager *TheFPM;
+static unsigned OptLevel = 0;
+// At -O2 and above, calls in the definitions made since the last top-level
+// expression are inlined before it runs; see InlinePending.
+static FunctionPassManager *TheInlineFPM;
+static InlineCostAnalyzer TheInlineCost;
+static int InlineThreshold = 0;
+static std::vector<Function*> PendingInline;
+static unsigned long NumInlinedCalls = 0;
+static IRBuilder<> MainBuilder(getGlobalContext());
+static __thread IRBuilder<> *Builder = &MainBuilder;
+// Batch workers get bodies the main thread has already optimized, and
+// leave the AST optimizer and its tables to it.
+static __thread bool BatchWorker = false;
+
+// Function handles by Symbol, so call sites and prototypes skip the
+// module's string-keyed lookup. A miss falls back to the module once.
+// Function types are cached by arity alongside, as they belong to the
+// same context.
+class FunctionCache {
+  std::vector<Function*> Functions;
+  std::vector<FunctionType*> Types;
+public:
+  Function *lookup(Symbol Name) {
+    if (Name < Functions.size() && Functions[Name])
+      return Functions[Name];
+    Function *F = TheModule->getFunction(Symbols.name(Name));
+    if (F)
+      set(Name, F);
+    return F;
+  }
+
+  void set(Symbol Name, Function *F) {
+    if (Functions.size() <= Name)
+      Functions.resize(Name + 1);
+    Functions[Name] = F;
+  }
+
+  void forget(Symbol Name, Function *F) {
+    if (Name < Functions.size() && Functions[Name] == F)
+      Functions[Name] = 0;
+  }
+
+  FunctionType *type(unsigned Arity) {
+    if (Types.size() <= Arity)
+      Types.resize(Arity + 1);
+    if (Types[Arity] == 0) {
+      LLVMContext &Context = TheModule->getContext();
+      std::vector<Type*> Doubles(Arity, Type::getDoubleTy(Context));
+      Types[Arity] = FunctionType::get(Type::getDoubleTy(Context), Doubles, false);
+    }
+    return Types[Arity];
+  }
+
+  void clear() { Functions.clear(); }
+};
+
+static FunctionCache MainCallees;
+static __thread FunctionCache *Callees = &MainCallees;
+
+static FunctionType *FunctionTypeFor(unsigned Arity) {
+  return Callees->type(Arity);
+}
+
+static void ForgetDeferredBody(Symbol Name, const Function *F);
+
+static void EraseFunction(Function *F, Symbol Name) {
+  Callees->forget(Name, F);
+  ForgetDeferredBody(Name, F);
+  std::vector<Function*>::iterator P =
+    std::find(PendingInline.begin(), PendingInline.end(), F);
+  if (P != PendingInline.end())
+    PendingInline.erase(P);
+  TheInlineCost.resetCachedCostInfo(F);
+  if (TheExecutionEngine)
+    TheExecutionEngine->freeMachineCodeForFunction(F);
+  F->eraseFromParent();
+}
+
+// Definitions use the fast calling convention, under which the JIT and
+// the code generator guarantee that a call marked as a tail call does not
+// grow the stack. Functions declared with 'extern' come from the host and
+// top-level expressions are called through C function pointers, so both
+// keep the C convention, as does a definition of a name declared extern.
+static std::vector<bool> HostFunctions;
+
+static bool IsHostFunction(Symbol Name) {
+  return Name < HostFunctions.size() && HostFunctions[Name];
+}
+
+static CallingConv::ID CallingConvFor(Symbol Name) {
+  return Name != SymAnon && !IsHostFunction(Name) ? CallingConv::Fast : CallingConv::C;
+}
+
+static Function *CreateFunction(Symbol Name, unsigned Arity) {
+  Function *F = Function::Create(FunctionTypeFor(Arity), Function::ExternalLinkage,
+                                 Symbols.name(Name), TheModule);
+  F->setCallingConv(CallingConvFor(Name));
+  return F;
+}
+
+// Returns a function with the C calling convention that passes its
+// arguments on to F, for callers outside the generated code.
+static Function *CreateCWrapper(Function *F, const std::string &Name,
+                                Function::LinkageTypes Linkage) {
+  Function *W = Function::Create(FunctionTypeFor(F->arg_size()), Linkage, Name, TheModule);
+  IRBuilder<> B(BasicBlock::Create(TheModule->getContext(), "entry", W));
+  std::vector<Value*> Args;
+  for (Function::arg_iterator AI = W->arg_begin(), AE = W->arg_end(); AI != AE; ++AI)
+    Args.push_back(AI);
+  CallInst *Call = B.CreateCall(F, Args, "calltmp");
+  Call->setCallingConv(F->getCallingConv());
+  B.CreateRet(Call);
+  return W;
+}
+
+// Queues a new body of the main module for InlinePending.
+static void AddPendingInline(Function *F) {
+  if (TheInlineFPM)
+    PendingInline.push_back(F);
+}
+
+// Inlines the calls in F that the cost model accepts, going round again
+// for calls the inlined bodies brought in, and returns whether it did any.
+static bool InlineCalls(Function *F) {
+  static SmallPtrSet<const Function*, 16> NeverInline;
+  InlineFunctionInfo IFI(0, TheExecutionEngine->getTargetData());
+  bool Changed = false;
+  for (unsigned Round = 0; Round != 4; ++Round) {
+    std::vector<CallInst*> Calls;
+    for (Function::iterator BB = F->begin(), BE = F->end(); BB != BE; ++BB)
+      for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I)
+        if (CallInst *CI = dyn_cast<CallInst>(I))
+          Calls.push_back(CI);
+
+    bool Inlined = false;
+    for (unsigned i = 0, e = Calls.size(); i != e; ++i) {
+      Function *Callee = Calls[i]->getCalledFunction();
+      if (Callee == 0 || Callee == F || Callee->isDeclaration())
+        continue;
+      InlineCost Cost = TheInlineCost.getInlineCost(CallSite(Calls[i]), NeverInline);
+      if (Cost.isNever() || (!Cost.isAlways() && Cost.getValue() >= InlineThreshold))
+        continue;
+      if (InlineFunction(Calls[i], IFI)) {
+        Inlined = true;
+        ++NumInlinedCalls;
+      }
+    }
+    if (!Inlined)
+      break;
+    Changed = true;
+    TheInlineCost.resetCachedCostInfo(F);
+  }
+  return Changed;
+}
+
+// Inlines into the definitions made since the last call, in the order
+// they were made, and into Expr, then cleans up what changed. Functions
+// the JIT has already compiled are skipped: rewriting their IR would not
+// change their machine code.
+static void InlinePending(Function *Expr) {
+  if (!TheInlineFPM)
+    return;
+  if (Expr)
+    PendingInline.push_back(Expr);
+  for (unsigned i = 0, e = PendingInline.size(); i != e; ++i) {
+    Function *F = PendingInline[i];
+    if (TheExecutionEngine->getPointerToGlobalIfAvailable(F) || !InlineCalls(F))
+      continue;
+    TheInlineFPM->run(*F);
+    TheInlineCost.resetCachedCostInfo(F);
+  }
+  PendingInline.clear();
+}
+
+Value *ErrorV(const char *Str) { Error(Str); return 0; }
+
+// A definition whose body is generated later: from source text with -lazy
+// and -lazy-jit, or from a kept tree (Body) with -tiered.
+struct DeferredBody {
+  PrototypeAST *Proto;
+  Function *F;
+  const char *Begin, *End;
+  ExprAST *Body;
+  unsigned long Calls;
+  bool Queued, Broken;
+};
+
+static bool LazyDefinitions = false, LazyJIT = false, Tiered = false;
+static Arena DeferredArena;
+static std::vector<DeferredBody*> DeferredBodies;
+static std::vector<Symbol> QueuedBodies;
+// The deferred bodies that call each one, for passing on Broken.
+static std::vector<std::vector<Symbol> > DeferredCallers;
+static std::vector<Symbol> BrokenBodies;
+static unsigned long NumDeferred = 0, NumCompiledLazily = 0;
+
+static DeferredBody *FindDeferredBody(Symbol Name) {
+  return Name < DeferredBodies.size() ? DeferredBodies[Name] : 0;
+}
+
+// An erased function takes its deferred body with it, so the name can be
+// defined again.
+static void ForgetDeferredBody(Symbol Name, const Function *F) {
+  DeferredBody *D = FindDeferredBody(Name);
+  if (D && D->F == F)
+    DeferredBodies[Name] = 0;
+}
+
+static void QueueDeferredBody(Symbol Name) {
+  if (LazyJIT || Tiered || BatchWorker)
+    return;
+  DeferredBody *D = FindDeferredBody(Name);
+  if (D && !D->Queued) {
+    D->Queued = true;
+    QueuedBodies.push_back(Name);
+  }
+}
+
+Value *ExprAST::Codegen(const std::vector<Value*> &Slots) const {
+  std::vector<Value*> Values(Nodes.size());
+
+  for (ExprRef i = 0, e = Nodes.size(); i != e; ++i) {
+    const ExprNode &N = Nodes[i];
+    Value *V = 0;
+
+    switch (N.Kind) {
+    case ExprNumber:
+      V = ConstantFP::get(TheModule->getContext(), APFloat(Literals[N.A]));
+      break;
+
+    case ExprVariable:
+      if (N.A == NoSlot)
+        return ErrorV("Unknown variable name");
+      V = Slots[N.A];
+      break;
+
+    case ExprBinary: {
+      Value *L = Values[N.A];
+      Value *R = Values[N.B];
+      switch (N.Op) {
+      case '+': V = Builder->CreateFAdd(L, R, "addtmp"); break;
+      case '-': V = Builder->CreateFSub(L, R, "subtmp"); break;
+      case '*': V = Builder->CreateFMul(L, R, "multmp"); break;
+      case '<':
+        L = Builder->CreateFCmpULT(L, R, "cmptmp");
+        V = Builder->CreateUIToFP(L, Type::getDoubleTy(TheModule->getContext()), "booltmp");
+        break;
+      default: return ErrorV("invalid binary operator");
+      }
+      break;
+    }
+
+    case ExprCall: {
+      Function *CalleeF = Callees->lookup(N.A);
+      if (CalleeF == 0)
+        return ErrorV("Unknown function referenced");
+
+      if (CalleeF->arg_size() != N.NumArgs)
+        return ErrorV("Incorrect # arguments passed");
+
+      QueueDeferredBody(N.A);
+
+      std::vector<Value*> ArgsV;
+      for (unsigned a = 0; a != N.NumArgs; ++a)
+        ArgsV.push_back(Values[Args[N.B + a]]);
+
+      CallInst *Call = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+      Call->setCallingConv(CalleeF->getCallingConv());
+      // The root is the body's only tail position. Between definitions
+      // the tail call is guaranteed, not just allowed.
+      if (i == Root)
+        Call->setTailCall();
+      V = Call;
+      break;
+    }
+    }
+
+    Values[i] = V;
+  }
+
+  return Values[Root];
+}
+
+Function *PrototypeAST::Codegen() {
+  Function *F = Name == SymAnon ? 0 : Callees->lookup(Name);
+  if (F == 0) {
+    F = CreateFunction(Name, Args.size());
+    if (Name != SymAnon)
+      Callees->set(Name, F);
+  } else {
+    if (!F->empty()) {
+      ErrorF("redefinition of function");
+      return 0;
+    }
+
+    if (F->arg_size() != Args.size()) {
+      ErrorF("redefinition of function with different # args");
+      return 0;
+    }
+  }
+
+  unsigned Idx = 0;
+  for (Function::arg_iterator AI = F->arg_begin(); Idx != Args.size(); ++AI, ++Idx)
+    AI->setName(Symbols.name(Args[Idx]));
+
+  return F;
+}
+
+// The AST optimizer rebuilds a body node by node before codegen, folding
+// constants with the same IEEE semantics the generated code would have and
+// applying identities that hold exactly. Rules that can change NaN, infinity
+// or signed-zero results only apply with -fast-math. Pure arguments passed
+// to parameters a callee never reads are replaced by 0.
+static bool ASTOptimize = false, FastMath = false, PruneArguments = true;
+static std::vector<std::vector<bool> > UsedParams;
+static unsigned long NumSimplified = 0, NumPrunedArgs = 0;
+
+static double FoldBinary(char Op, double L, double R) {
+  switch (Op) {
+  case '+': return L + R;
+  case '-': return L - R;
+  case '*': return L * R;
+  default:  return !(L >= R) ? 1.0 : 0.0;  // fcmp ult is true when unordered
+  }
+}
+
+static bool IsNegativeZero(double D) { return D == 0.0 && 1.0 / D < 0; }
+
+class ExprOptimizer {
+  ExprBuilder Out, Live;
+  std::vector<ExprRef> Map;
+  std::vector<char> Pure, Reachable;
+  std::vector<ExprRef> CallArgs;
+  Arena Storage;
+
+  bool constant(ExprRef R, double &Val) const {
+    if (Out.Nodes[R].Kind != ExprNumber) return false;
+    Val = Out.Literals[Out.Nodes[R].A];
+    return true;
+  }
+
+  bool sameValue(ExprRef L, ExprRef R) const {
+    const ExprNode &LN = Out.Nodes[L], &RN = Out.Nodes[R];
+    return L == R || (LN.Kind == ExprVariable && RN.Kind == ExprVariable &&
+                      LN.A == RN.A && LN.A != NoSlot);
+  }
+
+  // Whether R can be dropped: no calls, and no unknown names whose error
+  // codegen still has to report.
+  bool pure(ExprRef R) {
+    for (ExprRef i = Pure.size(), e = Out.Nodes.size(); i != e; ++i) {
+      const ExprNode &N = Out.Nodes[i];
+      switch (N.Kind) {
+      case ExprNumber:   Pure.push_back(true); break;
+      case ExprVariable: Pure.push_back(N.A != NoSlot); break;
+      case ExprBinary:   Pure.push_back(Pure[N.A] && Pure[N.B]); break;
+      case ExprCall:     Pure.push_back(false); break;
+      }
+    }
+    return Pure[R];
+  }
+
+  ExprRef reassociate(char Op, ExprRef Operand, double C) {
+    // Copied out: adding nodes may move Out.Nodes.
+    ExprNode N = Out.Nodes[Operand];
+    double Inner;
+    if (N.Kind != ExprBinary || N.Op != Op)
+      return NoExpr;
+    if (constant(N.B, Inner))
+      return Out.binary(Op, N.A, Out.number(FoldBinary(Op, Inner, C)));
+    if (constant(N.A, Inner))
+      return Out.binary(Op, N.B, Out.number(FoldBinary(Op, Inner, C)));
+    return NoExpr;
+  }
+
+  ExprRef simplify(char Op, ExprRef L, ExprRef R) {
+    if (Op != '+' && Op != '-' && Op != '*' && Op != '<')
+      return NoExpr;
+
+    double LV = 0, RV = 0;
+    bool LC = constant(L, LV), RC = constant(R, RV);
+    if (LC && RC)
+      return Out.number(FoldBinary(Op, LV, RV));
+
+    switch (Op) {
+    case '*':
+      if (RC && RV == 1.0) return L;
+      if (LC && LV == 1.0) return R;
+      if (FastMath && RC && RV == 0.0 && pure(L)) return Out.number(0.0);
+      if (FastMath && LC && LV == 0.0 && pure(R)) return Out.number(0.0);
+      break;
+    case '+':
+      // x + -0 is x for every x; x + +0 turns -0 into +0.
+      if (RC && RV == 0.0 && (FastMath || IsNegativeZero(RV))) return L;
+      if (LC && LV == 0.0 && (FastMath || IsNegativeZero(LV))) return R;
+      break;
+    case '-':
+      if (RC && RV == 0.0 && (FastMath || !IsNegativeZero(RV))) return L;
+      if (FastMath && sameValue(L, R) && pure(L)) return Out.number(0.0);
+      break;
+    }
+
+    if (FastMath && (Op == '+' || Op == '*')) {
+      ExprRef Res = NoExpr;
+      if (RC) Res = reassociate(Op, L, RV);
+      if (Res == NoExpr && LC) Res = reassociate(Op, R, LV);
+      return Res;
+    }
+    return NoExpr;
+  }
+
+  ExprRef rebuildCall(const ExprAST &In, const ExprNode &N) {
+    const std::vector<bool> *Used =
+      PruneArguments && N.A < UsedParams.size() ? &UsedParams[N.A] : 0;
+    if (Used && Used->size() != N.NumArgs)
+      Used = 0;
+
+    CallArgs.clear();
+    for (unsigned a = 0; a != N.NumArgs; ++a) {
+      ExprRef Arg = Map[In.Args[N.B + a]];
+      double Val;
+      if (Used && !(*Used)[a] && pure(Arg) && !(constant(Arg, Val) && Val == 0.0)) {
+        Arg = Out.number(0.0);
+        ++NumPrunedArgs;
+      }
+      CallArgs.push_back(Arg);
+    }
+    return Out.call(N.A, CallArgs);
+  }
+
+  // Copies the nodes reachable from Root into Live, dropping the ones the
+  // rewrites left behind.
+  ExprRef compact(ExprRef Root) {
+    Reachable.assign(Out.Nodes.size(), 0);
+    Reachable[Root] = 1;
+    for (ExprRef i = Root + 1; i-- != 0; ) {
+      if (!Reachable[i]) continue;
+      const ExprNode &N = Out.Nodes[i];
+      if (N.Kind == ExprBinary)
+        Reachable[N.A] = Reachable[N.B] = 1;
+      else if (N.Kind == ExprCall)
+        for (unsigned a = 0; a != N.NumArgs; ++a)
+          Reachable[Out.Args[N.B + a]] = 1;
+    }
+
+    Live.clear();
+    Map.assign(Out.Nodes.size(), NoExpr);
+    for (ExprRef i = 0; i <= Root; ++i) {
+      if (!Reachable[i]) continue;
+      const ExprNode &N = Out.Nodes[i];
+      switch (N.Kind) {
+      case ExprNumber:   Map[i] = Live.number(Out.Literals[N.A]); break;
+      case ExprVariable: Map[i] = Live.variable(N.A, N.B); break;
+      case ExprBinary:   Map[i] = Live.binary(N.Op, Map[N.A], Map[N.B]); break;
+      case ExprCall:
+        CallArgs.clear();
+        for (unsigned a = 0; a != N.NumArgs; ++a)
+          CallArgs.push_back(Map[Out.Args[N.B + a]]);
+        Map[i] = Live.call(N.A, CallArgs);
+        break;
+      }
+    }
+    return Map[Root];
+  }
+
+public:
+  // The result lives until the next call.
+  const ExprAST *run(const ExprAST &In) {
+    Out.clear();
+    Pure.clear();
+    Map.assign(In.Nodes.size(), NoExpr);
+
+    for (ExprRef i = 0, e = In.Nodes.size(); i != e; ++i) {
+      const ExprNode &N = In.Nodes[i];
+      switch (N.Kind) {
+      case ExprNumber:   Map[i] = Out.number(In.Literals[N.A]); break;
+      case ExprVariable: Map[i] = Out.variable(N.A, N.B); break;
+      case ExprCall:     Map[i] = rebuildCall(In, N); break;
+      case ExprBinary: {
+        ExprRef L = Map[N.A], R = Map[N.B];
+        Map[i] = simplify(N.Op, L, R);
+        if (Map[i] != NoExpr)
+          ++NumSimplified;
+        else
+          Map[i] = Out.binary(N.Op, L, R);
+        break;
+      }
+      }
+    }
+
+    ExprRef Root = compact(Map[In.Root]);
+    Storage.reset();
+    return new (Storage) ExprAST(Storage, Live, Root);
+  }
+};
+
+static ExprOptimizer TheOptimizer;
+
+static void RecordUsedParams(Symbol Name, unsigned NumArgs, const ExprAST &Body) {
+  if (Name == SymAnon)
+    return;
+  if (UsedParams.size() <= Name)
+    UsedParams.resize(Name + 1);
+  std::vector<bool> &Used = UsedParams[Name];
+  Used.assign(NumArgs, false);
+  for (ExprRef i = 0, e = Body.Nodes.size(); i != e; ++i)
+    if (Body.Nodes[i].Kind == ExprVariable && Body.Nodes[i].A < NumArgs)
+      Used[Body.Nodes[i].A] = true;
+}
+
+Function *FunctionAST::Codegen() {
+  Function *TheFunction = Proto->Codegen();
+  if (TheFunction == 0)
+    return 0;
+
+  bool Optimize = ASTOptimize && !BatchWorker;
+  const ExprAST *Expr = Optimize ? TheOptimizer.run(*Body) : Body;
+
+  std::vector<Value*> Slots;
+  Function::arg_iterator AI = TheFunction->arg_begin();
+  for (unsigned i = 0, e = Proto->getArgs().size(); i != e; ++i, ++AI)
+    Slots.push_back(AI);
+
+  BasicBlock *BB = BasicBlock::Create(TheModule->getContext(), "entry", TheFunction);
+  Builder->SetInsertPoint(BB);
+
+  Value *RetVal = Expr->Codegen(Slots);
+
+  if (RetVal) {
+    Builder->CreateRet(RetVal);
+    verifyFunction(*TheFunction);
+    TheFPM->run(*TheFunction);
+    // Scratch modules and batch workers have no engine; their bodies are
+    // queued once linked into the main module.
+    if (TheExecutionEngine && Proto->getName() != SymAnon)
+      AddPendingInline(TheFunction);
+    if (Optimize)
+      RecordUsedParams(Proto->getName(), Proto->getArgs().size(), *Expr);
+
+    // A new body for a function that has already been compiled replaces
+    // the old machine code, so existing callers reach it too.
+    if (TheExecutionEngine &&
+        TheExecutionEngine->getPointerToGlobalIfAvailable(TheFunction))
+      TheExecutionEngine->recompileAndRelinkFunction(TheFunction);
+    return TheFunction;
+  }
+
+  if (TheFunction->use_empty())
+    EraseFunction(TheFunction, Proto->getName());
+  else
+    TheFunction->deleteBody();
+  return 0;
+}
+
+static DeferredBody *AddDeferredBody(PrototypeAST *Proto, Function *F) {
+  DeferredBody *D = new (DeferredArena) DeferredBody();
+  D->Proto = new (DeferredArena) PrototypeAST(
+      Proto->getName(), ArenaArray<Symbol>(DeferredArena, Proto->getArgs()));
+  D->F = F;
+  D->Begin = D->End = 0;
+  D->Body = 0;
+  D->Calls = 0;
+  D->Queued = D->Broken = false;
+
+  if (DeferredBodies.size() <= Proto->getName())
+    DeferredBodies.resize(Proto->getName() + 1);
+  DeferredBodies[Proto->getName()] = D;
+  ++NumDeferred;
+  return D;
+}
+
+static void DeferDefinition(PrototypeAST *Proto, const char *Begin, const char *End) {
+  if (FindDeferredBody(Proto->getName())) {
+    ErrorF("redefinition of function");
+    return;
+  }
+  Function *F = Proto->Codegen();
+  if (!F)
+    return;
+
+  DeferredBody *D = AddDeferredBody(Proto, F);
+  D->Begin = Begin;
+  D->End = End;
+}
+
+// Reports the errors ExprAST::Codegen would, so a body that is only
+// interpreted is accepted or rejected exactly like a compiled one.
+static bool CheckExpr(const ExprAST &E) {
+  for (ExprRef i = 0, e = E.Nodes.size(); i != e; ++i) {
+    const ExprNode &N = E.Nodes[i];
+    switch (N.Kind) {
+    case ExprNumber:
+      break;
+    case ExprVariable:
+      if (N.A == NoSlot) {
+        Error("Unknown variable name");
+        return false;
+      }
+      break;
+    case ExprBinary:
+      if (N.Op != '+' && N.Op != '-' && N.Op != '*' && N.Op != '<') {
+        Error("invalid binary operator");
+        return false;
+      }
+      break;
+    case ExprCall: {
+      Function *CalleeF = Callees->lookup(N.A);
+      if (CalleeF == 0) {
+        Error("Unknown function referenced");
+        return false;
+      }
+      if (CalleeF->arg_size() != N.NumArgs) {
+        Error("Incorrect # arguments passed");
+        return false;
+      }
+      break;
+    }
+    }
+  }
+  return true;
+}
+
+// -tiered and -batch keep the checked tree instead of generating code for
+// it.
+static DeferredBody *DeferParsedDefinition(FunctionAST *Func) {
+  PrototypeAST *Proto = Func->getProto();
+  if (FindDeferredBody(Proto->getName())) {
+    ErrorF("redefinition of function");
+    return 0;
+  }
+  Function *F = Proto->Codegen();
+  if (!F)
+    return 0;
+
+  const ExprAST *Body = ASTOptimize ? TheOptimizer.run(*Func->getBody())
+                                    : Func->getBody();
+  if (!CheckExpr(*Body)) {
+    if (F->use_empty())
+      EraseFunction(F, Proto->getName());
+    return 0;
+  }
+  if (ASTOptimize)
+    RecordUsedParams(Proto->getName(), Proto->getArgs().size(), *Body);
+
+  DeferredBody *D = AddDeferredBody(Proto, F);
+  D->Body = new (DeferredArena) ExprAST(DeferredArena, *Body);
+  return D;
+}
+
+// A deferred body is broken if it failed to compile, or calls one that is.
+// Top-level expressions that call a broken body are not run, as they
+// would not have compiled had the definitions been generated eagerly.
+static void MarkBroken(Symbol Name) {
+  std::vector<Symbol> Work(1, Name);
+  while (!Work.empty()) {
+    Symbol S = Work.back();
+    Work.pop_back();
+    DeferredBody *D = FindDeferredBody(S);
+    if (D == 0 || D->Broken)
+      continue;
+    D->Broken = true;
+    BrokenBodies.push_back(S);
+    if (S < DeferredCallers.size())
+      Work.insert(Work.end(), DeferredCallers[S].begin(), DeferredCallers[S].end());
+  }
+}
+
+// Eager mode never defines a body that fails, so a broken one is erased
+// as soon as no caller refers to it any more, and its name can be
+// defined again. Erasing a broken caller may release its callees in turn.
+static void EraseBrokenBodies() {
+  for (bool Erased = true; Erased; ) {
+    Erased = false;
+    for (unsigned i = 0; i != BrokenBodies.size(); ) {
+      Symbol Name = BrokenBodies[i];
+      DeferredBody *D = FindDeferredBody(Name);
+      if (D && D->Broken && !D->F->use_empty()) {
+        ++i;
+        continue;
+      }
+      if (D && D->Broken) {
+        EraseFunction(D->F, Name);
+        Erased = true;
+      }
+      BrokenBodies.erase(BrokenBodies.begin() + i);
+    }
+  }
+}
+
+// Whether Body calls a broken deferred body; with Caller, also records
+// Caller as calling each deferred body it does.
+static bool CallsBrokenBody(const ExprAST &Body, DeferredBody *Caller) {
+  bool Broken = false;
+  for (ExprRef i = 0, e = Body.Nodes.size(); i != e; ++i) {
+    const ExprNode &N = Body.Nodes[i];
+    DeferredBody *Callee = N.Kind == ExprCall ? FindDeferredBody(N.A) : 0;
+    if (Callee == 0)
+      continue;
+    Broken |= Callee->Broken;
+    if (Caller) {
+      if (DeferredCallers.size() <= N.A)
+        DeferredCallers.resize(N.A + 1);
+      std::vector<Symbol> &Callers = DeferredCallers[N.A];
+      if (Callers.empty() || Callers.back() != Caller->Proto->getName())
+        Callers.push_back(Caller->Proto->getName());
+    }
+  }
+  return Broken;
+}
+
+static Function *CompileDeferredAST(DeferredBody *D, FunctionAST *F) {
+  Function *LF = F ? F->Codegen() : 0;
+  if (LF) {
+    fprintf(stderr, "Read function definition:");
+    LF->dump();
+    ++NumCompiledLazily;
+  }
+  if (LF == 0 || CallsBrokenBody(*F->getBody(), D))
+    MarkBroken(D->Proto->getName());
+  return LF;
+}
+
+static Function *CompileDeferredBody(DeferredBody *D) {
+  if (D->Body) {
+    FunctionAST F(D->Proto, D->Body);
+    return CompileDeferredAST(D, &F);
+  }
+
+  SourceBuffer Src;
+  Src.openMemory(D->Begin, D->End - D->Begin);
+  Lexer Lex(Src);
+  Parser TheParser(Lex);
+  return CompileDeferredAST(D, TheParser.ParseDeferredBody(D->Proto));
+}
+
+// Parses and generates every deferred body referenced so far, including
+// the ones those bodies reference in turn.
+static void CompileQueuedBodies() {
+  while (!QueuedBodies.empty()) {
+    DeferredBody *D = DeferredBodies[QueuedBodies.back()];
+    QueuedBodies.pop_back();
+    if (D && D->Queued && D->F->empty())
+      CompileDeferredBody(D);
+  }
+}
+
+// With -lazy-jit the JIT compiles lazily as well: a call to a deferred
+// function goes through a stub, and the first call asks this materializer
+// for the body, which is then parsed, generated, optimized and compiled
+// before the JIT patches the call site. A body that fails to compile
+// returns 0, so a running expression never reaches a missing function.
+class DeferredBodyMaterializer : public GVMaterializer {
+  static DeferredBody *find(const GlobalValue *GV) {
+    const Function *F = dyn_cast<Function>(GV);
+    if (!F || !F->empty() || F->getName().empty())
+      return 0;
+    DeferredBody *D = FindDeferredBody(Symbols.intern(F->getName().data(),
+                                                      F->getName().size()));
+    return D && D->F == F ? D : 0;
+  }
+
+public:
+  bool isMaterializable(const GlobalValue *GV) const { return find(GV) != 0; }
+  bool isDematerializable(const GlobalValue *) const { return false; }
+
+  bool Materialize(GlobalValue *GV, std::string *) {
+    DeferredBody *D = find(GV);
+    if (D == 0)
+      return false;
+    // The JIT still refers to F, so a failed body leaves it in the module.
+    Function *F = D->F;
+    if (CompileDeferredBody(D))
+      return false;
+
+    fprintf(stderr, "Error: body of '%s' failed to compile, calls return 0\n",
+            Symbols.name(D->Proto->getName()).c_str());
+    Builder->SetInsertPoint(BasicBlock::Create(getGlobalContext(), "entry", F));
+    Builder->CreateRet(ConstantFP::get(getGlobalContext(), APFloat(0.0)));
+    return false;
+  }
+
+  bool MaterializeModule(Module *M, std::string *ErrInfo) {
+    // By name, as a body that fails to compile may erase another function.
+    std::vector<std::string> Pending;
+    for (Module::iterator I = M->begin(), E = M->end(); I != E; ++I)
+      if (isMaterializable(I))
+        Pending.push_back(I->getName().str());
+    for (unsigned i = 0, e = Pending.size(); i != e; ++i)
+      if (Function *F = M->getFunction(Pending[i]))
+        if (isMaterializable(F))
+          Materialize(F, ErrInfo);
+    return false;
+  }
+};
+
+static void BenchParse(unsigned Operands) {
+  static const char Ops[] = { '+', '*', '-', '<' };
+  std::string Chain = "x0";
+  char Buf[32];
+  for (unsigned i = 1; i != Operands; ++i) {
+    sprintf(Buf, " %c x%u", Ops[i % 4], i % 1000);
+    Chain += Buf;
+  }
+  Chain += ";";
+
+  SourceBuffer Src;
+  Src.openMemory(Chain.data(), Chain.size());
+  TokenStream Tokens;
+  Lexer Lex(Src);
+  Tokens.lex(Lex);
+
+  double Best = 0;
+  for (unsigned Run = 0; Run != 5; ++Run) {
+    Parser P(Tokens);
+    P.getNextToken();
+    double Start = Now();
+    FunctionAST *F = P.ParseTopLevelExpr();
+    double Elapsed = Now() - Start;
+    if (!F) return;
+    P.releaseNodes();
+    if (Run == 0 || Elapsed < Best) Best = Elapsed;
+  }
+
+  fprintf(stderr, "Parsed a %u-operator chain in %.3f s (%.1f ns/operator)\n",
+          Operands - 1, Best, Best * 1e9 / (Operands - 1));
+}
+
+static bool StressDepth(unsigned Depth) {
+  static const char *Shapes[][3] = {
+    { "nested parens", "(", ")" },
+    { "right-nested sums", "1+(", ")" },
+    { "nested calls", "stressf(", ")" },
+    { "nested call arguments", "stressg(1, ", ", 2)" },
+  };
+
+  std::string Externs = "extern stressf(x); extern stressg(a b c);";
+  SourceBuffer ExternSrc;
+  ExternSrc.openMemory(Externs.data(), Externs.size());
+  Lexer ExternLex(ExternSrc);
+  Parser ExternParser(ExternLex);
+  ExternParser.getNextToken();
+  for (unsigned i = 0; i != 2; ++i) {
+    PrototypeAST *P = ExternParser.ParseExtern();
+    if (!P || !P->Codegen()) return false;
+    ExternParser.getNextToken();
+  }
+
+  bool Ok = true;
+  for (unsigned i = 0; i != sizeof(Shapes) / sizeof(Shapes[0]); ++i) {
+    std::string Text;
+    Text.reserve(Depth * (strlen(Shapes[i][1]) + strlen(Shapes[i][2])) + 2);
+    for (unsigned d = 0; d != Depth; ++d)
+      Text += Shapes[i][1];
+    Text += "1";
+    for (unsigned d = 0; d != Depth; ++d)
+      Text += Shapes[i][2];
+    Text += ";";
+
+    SourceBuffer Src;
+    Src.openMemory(Text.data(), Text.size());
+    Lexer Lex(Src);
+    Parser P(Lex);
+    P.getNextToken();
+
+    double Start = Now();
+    FunctionAST *F = P.ParseTopLevelExpr();
+    double Parsed = Now();
+    Function *LF = F ? F->Codegen() : 0;
+    double Generated = Now();
+
+    fprintf(stderr, "%s, depth %u: parse %.3f s, codegen %.3f s%s\n",
+            Shapes[i][0], Depth, Parsed - Start, Generated - Parsed,
+            LF ? "" : " FAILED");
+    if (LF)
+      LF->eraseFromParent();
+    else
+      Ok = false;
+    P.releaseNodes();
+  }
+  return Ok;
+}
+
+// Parses a generated program with CallSites calls spread over functions of
+// 64 calls each, then times codegen alone.
+static bool BenchCodegen(unsigned CallSites) {
+  static const char *Calls[] = { "bc0()", "bc1(x)", "bc2(x, 1)", "bc3(x, x, 2)" };
+
+  std::string Source = "def bc0() 1; def bc1(a) a; def bc2(a b) a; def bc3(a b c) a;\n";
+  char Buf[32];
+  unsigned Bodies = (CallSites + 63) / 64;
+  for (unsigned i = 0; i != Bodies; ++i) {
+    sprintf(Buf, "def bcbody%u(x) ", i);
+    Source += Buf;
+    for (unsigned c = 0; c != 64; ++c) {
+      if (c) Source += " + ";
+      Source += Calls[(i + c) % 4];
+    }
+    Source += ";\n";
+  }
+
+  SourceBuffer Src;
+  Src.openMemory(Source.data(), Source.size());
+  Lexer Lex(Src);
+  Parser P(Lex);
+  P.getNextToken();
+  std::vector<FunctionAST*> Functions;
+  while (P.getCurTok() == tok_def) {
+    FunctionAST *F = P.ParseDefinition();
+    if (!F) return false;
+    Functions.push_back(F);
+    while (P.getCurTok() == ';')
+      P.getNextToken();
+  }
+
+  double Start = Now();
+  for (unsigned i = 0, e = Functions.size(); i != e; ++i)
+    if (!Functions[i]->Codegen())
+      return false;
+  double Elapsed = Now() - Start;
+
+  fprintf(stderr, "Generated %u call sites in %u functions in %.3f s (%.0f call sites/s)\n",
+          Bodies * 64, Bodies, Elapsed, Bodies * 64 / Elapsed);
+  return true;
+}
+
+static bool ShowStats = false;
+static double StartTime;
+
+// Mixed-mode execution (-tiered N): definitions are checked and kept as
+// trees, top-level expressions run in the interpreter below, and a function
+// is compiled once the interpreter has called it N times. From then on
+// interpreted callers go straight to its machine code. Compiled code never
+// calls back into the interpreter; it reaches the functions that are still
+// interpreted through DeferredBodyMaterializer, like -lazy-jit.
+static unsigned long TierThreshold = 0;
+static unsigned long NumInterpreted = 0, NumNativeEntries = 0, NumPromotions = 0;
+static double InterpretSeconds = 0, NativeSeconds = 0, PromoteSeconds = 0;
+
+// Machine code entry the interpreter can call with any number of arguments:
+// double name.entry(double *Args) loads them and calls the function.
+typedef double (*NativeEntry)(const double *Args);
+static std::vector<NativeEntry> NativeEntries;
+
+static NativeEntry GetNativeEntry(Symbol Name) {
+  if (Name < NativeEntries.size() && NativeEntries[Name])
+    return NativeEntries[Name];
+
+  LLVMContext &Context = getGlobalContext();
+  Function *F = Callees->lookup(Name);
+  std::vector<Type*> Params(1, PointerType::getUnqual(Type::getDoubleTy(Context)));
+  Function *Entry = Function::Create(
+      FunctionType::get(Type::getDoubleTy(Context), Params, false),
+      Function::InternalLinkage, Symbols.name(Name) + ".entry", TheModule);
+
+  IRBuilder<> B(BasicBlock::Create(Context, "entry", Entry));
+  Value *ArgArray = Entry->arg_begin();
+  std::vector<Value*> Args;
+  for (unsigned i = 0, e = F->arg_size(); i != e; ++i)
+    Args.push_back(B.CreateLoad(B.CreateConstGEP1_32(ArgArray, i), "arg"));
+  CallInst *Call = B.CreateCall(F, Args, "calltmp");
+  Call->setCallingConv(F->getCallingConv());
+  B.CreateRet(Call);
+
+  if (NativeEntries.size() <= Name)
+    NativeEntries.resize(Name + 1);
+  NativeEntries[Name] = (NativeEntry)(intptr_t)TheExecutionEngine->getPointerToFunction(Entry);
+  return NativeEntries[Name];
+}
+
+static void Promote(DeferredBody *D) {
+  double Start = ShowStats ? Now() : 0;
+  // A compiled caller may already have materialized the body.
+  if (D->F->empty())
+    CompileDeferredBody(D);
+  InlinePending(0);
+  TheExecutionEngine->getPointerToFunction(D->F);
+  GetNativeEntry(D->Proto->getName());
+  ++NumPromotions;
+  if (ShowStats)
+    PromoteSeconds += Now() - Start;
+}
+
+// Frames live on one stack: each call pushes its arguments and then a value
+// per node, addressed by index because nested calls may grow the stack.
+static std::vector<double> InterpreterStack;
+
+static double Interpret(const ExprAST &E, size_t ArgBase);
+
+static double CallFunction(Symbol Name, size_t ArgBase) {
+  DeferredBody *D = FindDeferredBody(Name);
+  bool Native = Name < NativeEntries.size() && NativeEntries[Name];
+  if (D && D->Body && !Native) {
+    if (++D->Calls < TierThreshold) {
+      ++NumInterpreted;
+      return Interpret(*D->Body, ArgBase);
+    }
+    Promote(D);
+  }
+
+  // Externs, and functions that are only declared so far, are called
+  // through the JIT as well.
+  NativeEntry Entry = GetNativeEntry(Name);
+  ++NumNativeEntries;
+  if (!ShowStats)
+    return Entry(&InterpreterStack[ArgBase]);
+  double Start = Now();
+  double Result = Entry(&InterpreterStack[ArgBase]);
+  NativeSeconds += Now() - Start;
+  return Result;
+}
+
+static double Interpret(const ExprAST &E, size_t ArgBase) {
+  std::vector<double> &Stack = InterpreterStack;
+  size_t Base = Stack.size();
+  Stack.resize(Base + E.Nodes.size());
+
+  for (ExprRef i = 0, e = E.Nodes.size(); i != e; ++i) {
+    const ExprNode &N = E.Nodes[i];
+    double V = 0;
+
+    switch (N.Kind) {
+    case ExprNumber:   V = E.Literals[N.A]; break;
+    case ExprVariable: V = Stack[ArgBase + N.A]; break;
+
+    case ExprBinary: {
+      double L = Stack[Base + N.A], R = Stack[Base + N.B];
+      switch (N.Op) {
+      case '+': V = L + R; break;
+      case '-': V = L - R; break;
+      case '*': V = L * R; break;
+      case '<': V = !(L >= R); break; // fcmp ult: true when unordered
+      }
+      break;
+    }
+
+    case ExprCall: {
+      size_t CallBase = Stack.size();
+      for (unsigned a = 0; a != N.NumArgs; ++a) {
+        double Arg = Stack[Base + E.Args[N.B + a]];
+        Stack.push_back(Arg);
+      }
+      V = CallFunction(N.A, CallBase);
+      Stack.resize(CallBase);
+      break;
+    }
+    }
+
+    Stack[Base + i] = V;
+  }
+
+  double Result = Stack[Base + E.Root];
+  Stack.resize(Base);
+  return Result;
+}
+
+static Arena TopLevelArena;
+
+static bool InterpretTopLevel(FunctionAST *Func, double &Result) {
+  const ExprAST *Body = Func->getBody();
+  if (ASTOptimize) {
+    // Promoting a function mid-expression runs the optimizer again.
+    TopLevelArena.reset();
+    Body = new (TopLevelArena) ExprAST(TopLevelArena, *TheOptimizer.run(*Body));
+  }
+  if (!CheckExpr(*Body))
+    return false;
+
+  double Start = ShowStats ? Now() : 0;
+  double Elsewhere = NativeSeconds + PromoteSeconds;
+  ++NumInterpreted;
+  Result = Interpret(*Body, 0);
+  if (ShowStats)
+    InterpretSeconds += Now() - Start - (NativeSeconds + PromoteSeconds - Elsewhere);
+  return true;
+}
+
+static void ReleaseItem(Parser &TheParser) {
+  size_t Bytes = TheParser.releaseNodes();
+  if (ShowStats)
+    fprintf(stderr, "AST arena: %lu bytes for this item\n", (unsigned long)Bytes);
+}
+
+struct TopLevelItem {
+  int Kind;
+  PrototypeAST *Proto;
+  FunctionAST *Func;
+  const char *BodyBegin, *BodyEnd;
+  std::string Errors;
+
+  TopLevelItem() : Kind(0), Proto(0), Func(0), BodyBegin(0), BodyEnd(0) {}
+};
+
+// Parses the definition, extern or top-level expression at the current
+// token. On a parse error the offending token is skipped.
+static void ParseTopLevelItem(Parser &TheParser, TopLevelItem &Item) {
+  Item.Kind = TheParser.getCurTok();
+  switch (Item.Kind) {
+  case tok_def:
+    if (LazyDefinitions && !Tiered && TheParser.getSourceText())
+      Item.Proto = TheParser.PreParseDefinition(Item.BodyBegin, Item.BodyEnd);
+    else
+      Item.Func = TheParser.ParseDefinition();
+    break;
+  case tok_extern: Item.Proto = TheParser.ParseExtern(); break;
+  default:         Item.Func = TheParser.ParseTopLevelExpr(); break;
+  }
+
+  if (!Item.Func && !Item.Proto)
+    TheParser.getNextToken();
+}
+
+static FunctionPassManager *CreateFunctionPasses(Module *M, const TargetData &TD);
+
+// Points this thread's codegen state at a module of its own while in
+// scope, for batch workers and the code cache. The module starts out
+// empty, so compile() first declares every function the body calls;
+// the caller has already checked the calls.
+class ScratchModule {
+  Module *SavedModule;
+  ExecutionEngine *SavedEngine;
+  FunctionPassManager *SavedFPM;
+  IRBuilder<> *SavedBuilder;
+  FunctionCache *SavedCallees;
+  Module *M;
+  IRBuilder<> ScratchBuilder;
+  FunctionCache ScratchCallees;
+
+  ScratchModule(const ScratchModule &);
+  void operator=(const ScratchModule &);
+
+public:
+  ScratchModule(LLVMContext &Context, const TargetData &TD)
+    : SavedModule(TheModule), SavedEngine(TheExecutionEngine), SavedFPM(TheFPM),
+      SavedBuilder(Builder), SavedCallees(Callees),
+      M(new Module("Pon scratch", Context)), ScratchBuilder(Context) {
+    TheModule = M;
+    TheExecutionEngine = 0;
+    TheFPM = CreateFunctionPasses(M, TD);
+    Builder = &ScratchBuilder;
+    Callees = &ScratchCallees;
+  }
+
+  ~ScratchModule() {
+    delete TheFPM;
+    TheModule = SavedModule;
+    TheExecutionEngine = SavedEngine;
+    TheFPM = SavedFPM;
+    Builder = SavedBuilder;
+    Callees = SavedCallees;
+    delete M;
+  }
 
-static int gettok() {
-  static int LastChar = ' ';
+  Module *getModule() const { return M; }
 
-  while (isspace(LastChar))
-    LastChar = getchar();
+  // Hands the module over to the caller.
+  Module *take() {
+    Module *Result = M;
+    M = 0;
+    return Result;
+  }
+
+  Function *compile(PrototypeAST *Proto, ExprAST *Body) {
+    for (ExprRef i = 0, e = Body->Nodes.size(); i != e; ++i) {
+      const ExprNode &N = Body->Nodes[i];
+      if (N.Kind == ExprCall && !Callees->lookup(N.A))
+        Callees->set(N.A, CreateFunction(N.A, N.NumArgs));
+    }
+    FunctionAST F(Proto, Body);
+    return F.Codegen();
+  }
+};
 
-  if (isalpha(LastChar)) {
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
-      IdentifierStr += LastChar;
+// Persistent code cache (-cache DIR). Each definition is keyed by a hash
+// of everything its optimized IR is derived from: target triple and CPU,
+// optimization level, prototype, and the body as it reaches codegen, with
+// callees by name. The calling convention of the function and of each
+// callee is hashed as well, since a name declared extern keeps C's. The JIT cannot load machine code, so an entry holds the
+// function's optimized bitcode. A hit skips IR generation and the function
+// passes, and leaves only the backend to the JIT. Entries are written
+// under a temporary name and renamed into place. When the directory grows
+// past the limit (-cache-limit MB), the least recently used entries are
+// deleted down to three quarters of it, so the directory is not rescanned
+// on every store; a hit touches its entry.
+static const char *CacheDir = 0;
+static const char *const CacheFormat = "pon-cache-3";
+static unsigned long CacheLimit = 256UL << 20, CacheBytes = 0;
+static unsigned long NumCacheHits = 0, NumCacheMisses = 0, NumCacheEvictions = 0;
+
+static void HashBytes(uint64_t &H, const void *Data, size_t Len) {
+  const unsigned char *P = (const unsigned char*)Data;
+  for (size_t i = 0; i != Len; ++i)
+    H = (H ^ P[i]) * 1099511628211ULL;
+}
 
-    if (IdentifierStr == "def") return tok_def;
-    if (IdentifierStr == "extern") return tok_extern;
-    return tok_identifier;
+static void HashString(uint64_t &H, const std::string &Str) {
+  unsigned Len = Str.size();
+  HashBytes(H, &Len, sizeof(Len));
+  HashBytes(H, Str.data(), Len);
+}
+
+static std::string CacheKey(const PrototypeAST &Proto, const ExprAST &Body) {
+  static const std::string Target =
+    sys::getHostTriple() + " " + sys::getHostCPUName();
+
+  uint64_t H = 14695981039346656037ULL;
+  HashString(H, CacheFormat);
+  HashString(H, Target);
+  HashBytes(H, &OptLevel, sizeof(OptLevel));
+  HashString(H, Symbols.name(Proto.getName()));
+  unsigned CC = CallingConvFor(Proto.getName());
+  HashBytes(H, &CC, sizeof(CC));
+  for (unsigned i = 0, e = Proto.getArgs().size(); i != e; ++i)
+    HashString(H, Symbols.name(Proto.getArgs()[i]));
+
+  for (ExprRef i = 0, e = Body.Nodes.size(); i != e; ++i) {
+    const ExprNode &N = Body.Nodes[i];
+    HashBytes(H, &N.Kind, sizeof(N.Kind));
+    switch (N.Kind) {
+    case ExprNumber:   HashBytes(H, &Body.Literals[N.A], sizeof(double)); break;
+    case ExprVariable: HashBytes(H, &N.A, sizeof(N.A)); break;
+    case ExprBinary:
+      HashBytes(H, &N.Op, sizeof(N.Op));
+      HashBytes(H, &N.A, sizeof(N.A));
+      HashBytes(H, &N.B, sizeof(N.B));
+      break;
+    case ExprCall:
+      HashString(H, Symbols.name(N.A));
+      CC = CallingConvFor(N.A);
+      HashBytes(H, &CC, sizeof(CC));
+      HashBytes(H, &N.NumArgs, sizeof(N.NumArgs));
+      for (unsigned a = 0; a != N.NumArgs; ++a)
+        HashBytes(H, &Body.Args[N.B + a], sizeof(ExprRef));
+      break;
+    }
   }
+  HashBytes(H, &Body.Root, sizeof(Body.Root));
 
-  if (isdigit(LastChar) || LastChar == '.') {
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = getchar();
-    } while (isdigit(LastChar) || LastChar == '.');
+  char Name[32];
+  sprintf(Name, "%016llx.bc", (unsigned long long)H);
+  return std::string(CacheDir) + "/" + Name;
+}
 
-    NumVal = strtod(NumStr.c_str(), 0);
-    return tok_number;
+struct CacheEntry {
+  time_t Used;
+  off_t Size;
+  std::string Path;
+
+  bool operator<(const CacheEntry &Other) const { return Used < Other.Used; }
+};
+
+// Recounts the entries on disk, which other processes may share, and if
+// they exceed the limit deletes the least recently used ones.
+static void TrimCache() {
+  DIR *Dir = opendir(CacheDir);
+  if (!Dir)
+    return;
+  std::vector<CacheEntry> Entries;
+  CacheBytes = 0;
+  while (struct dirent *D = readdir(Dir)) {
+    size_t Len = strlen(D->d_name);
+    if (Len < 3 || strcmp(D->d_name + Len - 3, ".bc"))
+      continue;
+    CacheEntry E;
+    E.Path = std::string(CacheDir) + "/" + D->d_name;
+    struct stat St;
+    if (stat(E.Path.c_str(), &St))
+      continue;
+    E.Used = St.st_mtime;
+    E.Size = St.st_size;
+    Entries.push_back(E);
+    CacheBytes += St.st_size;
   }
+  closedir(Dir);
+
+  if (CacheBytes <= CacheLimit)
+    return;
+  std::sort(Entries.begin(), Entries.end());
+  for (unsigned i = 0; i != Entries.size() && CacheBytes > CacheLimit / 4 * 3; ++i)
+    if (unlink(Entries[i].Path.c_str()) == 0) {
+      CacheBytes -= Entries[i].Size;
+      ++NumCacheEvictions;
+    }
+}
 
-  if (LastChar == '#') {
-    do LastChar = getchar();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+static bool OpenCache() {
+  if (mkdir(CacheDir, 0777) && errno != EEXIST) {
+    fprintf(stderr, "Error: could not create cache directory '%s'\n", CacheDir);
+    return false;
+  }
+  TrimCache();
+  return true;
+}
 
-    if (LastChar != EOF)
-      return gettok();
+// Returns the entry's module if it holds a body for Name; a damaged entry
+// is deleted.
+static Module *LoadCacheEntry(const std::string &Path, const std::string &Name) {
+  FILE *File = fopen(Path.c_str(), "rb");
+  if (!File)
+    return 0;
+  std::string Bitcode;
+  char Buf[16384];
+  for (size_t N; (N = fread(Buf, 1, sizeof(Buf), File)) != 0; )
+    Bitcode.append(Buf, N);
+  fclose(File);
+
+  MemoryBuffer *Buffer = MemoryBuffer::getMemBuffer(Bitcode);
+  Module *M = ParseBitcodeFile(Buffer, getGlobalContext());
+  delete Buffer;
+  Function *F = M ? M->getFunction(Name) : 0;
+  if (F == 0 || F->empty()) {
+    delete M;
+    unlink(Path.c_str());
+    return 0;
   }
+  utime(Path.c_str(), 0);
+  return M;
+}
 
-  if (LastChar == EOF)
-    return tok_eof;
+static void StoreCacheEntry(const std::string &Path, const Module *M) {
+  std::string Bitcode;
+  raw_string_ostream OS(Bitcode);
+  WriteBitcodeToFile(M, OS);
+  OS.flush();
+
+  char Suffix[32];
+  sprintf(Suffix, ".%ld.tmp", (long)getpid());
+  std::string TempPath = Path + Suffix;
+  FILE *File = fopen(TempPath.c_str(), "wb");
+  if (!File)
+    return;
+  bool Written = fwrite(Bitcode.data(), 1, Bitcode.size(), File) == Bitcode.size();
+  if (fclose(File) || !Written || rename(TempPath.c_str(), Path.c_str())) {
+    unlink(TempPath.c_str());
+    return;
+  }
 
-  int ThisChar = LastChar;
-  LastChar = getchar();
-  return ThisChar;
+  CacheBytes += Bitcode.size();
+  if (CacheBytes > CacheLimit)
+    TrimCache();
 }
 
-class ExprAST {
-public:
-  virtual ~ExprAST() {}
-  virtual Value *Codegen() = 0;
-};
+// Defines Func from its cache entry, or generates it into a scratch module
+// and stores that, then links the result into the main module.
+static Function *CompileCached(FunctionAST *Func) {
+  PrototypeAST *Proto = Func->getProto();
+  Function *F = Proto->Codegen();
+  if (F == 0)
+    return 0;
 
-class NumberExprAST : public ExprAST {
-  double Val;
-public:
-  NumberExprAST(double val) : Val(val) {}
-  virtual Value *Codegen();
-};
+  const ExprAST *Body = ASTOptimize ? TheOptimizer.run(*Func->getBody())
+                                    : Func->getBody();
+  if (!CheckExpr(*Body)) {
+    if (F->use_empty())
+      EraseFunction(F, Proto->getName());
+    return 0;
+  }
+  if (ASTOptimize)
+    RecordUsedParams(Proto->getName(), Proto->getArgs().size(), *Body);
+  std::string Path = CacheKey(*Proto, *Body);
 
-class VariableExprAST : public ExprAST {
-  std::string Name;
-public:
-  VariableExprAST(const std::string &name) : Name(name) {}
-  virtual Value *Codegen();
-};
+  Module *M = LoadCacheEntry(Path, Symbols.name(Proto->getName()));
+  if (M) {
+    ++NumCacheHits;
+  } else {
+    ++NumCacheMisses;
+    ScratchModule Scratch(getGlobalContext(), *TheExecutionEngine->getTargetData());
+    if (!Scratch.compile(Proto, Func->getBody()))
+      return 0;
+    M = Scratch.take();
+    StoreCacheEntry(Path, M);
+  }
 
-class BinaryExprAST : public ExprAST {
-  char Op;
-  ExprAST *LHS, *RHS;
-public:
-  BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs)
-    : Op(op), LHS(lhs), RHS(rhs) {}
-  virtual Value *Codegen();
-};
+  std::string ErrStr;
+  bool Failed = Linker::LinkModules(TheModule, M, Linker::DestroySource, &ErrStr);
+  delete M;
+  if (Failed) {
+    fprintf(stderr, "Error: could not link cached '%s': %s\n",
+            Symbols.name(Proto->getName()).c_str(), ErrStr.c_str());
+    return 0;
+  }
 
-class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<ExprAST*> Args;
-public:
-  CallExprAST(const std::string &callee, std::vector<ExprAST*> &args)
-    : Callee(callee), Args(args) {}
-  virtual Value *Codegen();
-};
+  // Linking replaced the declaration.
+  F = TheModule->getFunction(Symbols.name(Proto->getName()));
+  Callees->set(Proto->getName(), F);
+  AddPendingInline(F);
+  return F;
+}
 
-class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
-public:
-  PrototypeAST(const std::string &name, const std::vector<std::string> &args)
-    : Name(name), Args(args) {}
+// Ahead-of-time mode (-aot NAME) keeps each top-level expression in the
+// module as NAME_exprN, along with the value the JIT computed for it.
+static const char *AOTName = 0;
+static std::string AOTPrefix;
+static std::vector<std::string> AOTExprNames;
+static std::vector<double> AOTExprValues;
+
+static void KeepTopLevelExpr(Function *F, double Value) {
+  char Suffix[32];
+  sprintf(Suffix, "_expr%lu", (unsigned long)AOTExprNames.size());
+  F->setName(AOTPrefix + Suffix);
+  AOTExprNames.push_back(F->getName().str());
+  AOTExprValues.push_back(Value);
+}
 
-  Function *Codegen();
-};
+static void ReportResult(double Value) {
+  fprintf(stderr, "Evaluated to %f\n", Value);
 
-class FunctionAST {
-  PrototypeAST *Proto;
-  ExprAST *Body;
-public:
-  FunctionAST(PrototypeAST *proto, ExprAST *body)
-    : Proto(proto), Body(body) {}
+  static bool ReportedFirstResult = false;
+  if (ShowStats && !ReportedFirstResult) {
+    fprintf(stderr, "First result after %.3f ms\n", (Now() - StartTime) * 1000);
+    ReportedFirstResult = true;
+  }
+}
 
-  Function *Codegen();
-};
+// Incremental mode keeps each top-level expression's function, to run it
+// again after an edit; otherwise it is erased, machine code and all, once
+// its result is printed, so a long session does not grow with every line.
+static bool KeepExprFunctions = false;
+
+// Marks Name as provided by the host. Calls to a name a definition has
+// already declared were compiled with the fast convention, so that name
+// cannot become an extern.
+static bool DeclareHostFunction(Symbol Name) {
+  Function *F = Callees->lookup(Name);
+  if (F && F->getCallingConv() != CallingConv::C) {
+    Error("extern for a function declared by a definition");
+    return false;
+  }
+  if (HostFunctions.size() <= Name)
+    HostFunctions.resize(Name + 1);
+  HostFunctions[Name] = true;
+  return true;
+}
 
-static int CurTok;
-static int getNextToken() {
-  return CurTok = gettok();
+static double RunExpr(Function *F) {
+  double (*FP)() = (double (*)())(intptr_t)TheExecutionEngine->getPointerToFunction(F);
+  return FP();
 }
 
-static std::map<char, int> BinopPrecedence;
+// Returns the function the item defined or declared, or null on error.
+// An expression's function is returned only while it is kept.
+static Function *CodegenTopLevelItem(const TopLevelItem &Item) {
+  fputs(Item.Errors.c_str(), stderr);
+
+  Function *Result = 0;
+  switch (Item.Kind) {
+  case tok_def:
+    if (Item.Proto)
+      DeferDefinition(Item.Proto, Item.BodyBegin, Item.BodyEnd);
+    if (Item.Func && Tiered)
+      DeferParsedDefinition(Item.Func);
+    else if (Item.Func)
+      if (Function *LF = CacheDir ? CompileCached(Item.Func) : Item.Func->Codegen()) {
+        fprintf(stderr, "Read function definition:");
+        LF->dump();
+        Result = LF;
+      }
+    break;
+  case tok_extern:
+    if (Item.Proto && DeclareHostFunction(Item.Proto->getName()))
+      if (Function *F = Item.Proto->Codegen()) {
+        fprintf(stderr, "Read extern: ");
+        F->dump();
+        Result = F;
+      }
+    break;
+  default: {
+    double Value;
+    if (Item.Func && Tiered && InterpretTopLevel(Item.Func, Value))
+      ReportResult(Value);
+    else if (Item.Func && !Tiered)
+      if (Function *LF = Item.Func->Codegen()) {
+        fprintf(stderr, "Read top-level expression:");
+        LF->dump();
+        Result = LF;
+      }
+    break;
+  }
+  }
 
-static int GetTokPrecedence() {
-  if (!isascii(CurTok))
-    return -1;
+  CompileQueuedBodies();
+
+  if (Result && Item.Kind != tok_def && Item.Kind != tok_extern &&
+      CallsBrokenBody(*Item.Func->getBody(), 0)) {
+    Error("expression calls a function whose body failed to compile");
+    EraseFunction(Result, SymAnon);
+    Result = 0;
+  }
+
+  if (Result && Item.Kind != tok_def && Item.Kind != tok_extern) {
+    InlinePending(Result);
+    double Value = RunExpr(Result);
+    ReportResult(Value);
+    if (AOTName) {
+      KeepTopLevelExpr(Result, Value);
+    } else if (!KeepExprFunctions) {
+      EraseFunction(Result, SymAnon);
+      Result = 0;
+    }
+  }
+  EraseBrokenBodies();
+  return Result;
+}
 
-  int TokPrec = BinopPrecedence[CurTok];
-  if (TokPrec <= 0) return -1;
-  return TokPrec;
+static void HandleTopLevelItem(Parser &TheParser) {
+  TopLevelItem Item;
+  ParseTopLevelItem(TheParser, Item);
+  CodegenTopLevelItem(Item);
+  ReleaseItem(TheParser);
 }
 
-ExprAST *Error(const char *Str) { fprintf(stderr, "Error: %s\n", Str);return 0;}
-PrototypeAST *ErrorP(const char *Str) { Error(Str); return 0; }
-FunctionAST *ErrorF(const char *Str) { Error(Str); return 0; }
+static void MainLoop(Parser &TheParser) {
+  while (1) {
+    fprintf(stderr, "pon> ");
+    switch (TheParser.getCurTok()) {
+    case tok_eof: return;
+    case ';':     TheParser.getNextToken(); break;
+    default:      HandleTopLevelItem(TheParser); break;
+    }
+  }
+}
 
-static ExprAST *ParseExpression();
+static bool InComment(const char *LineBegin, const char *P) {
+  while (P != LineBegin && P[-1] != '\n' && P[-1] != '\r')
+    if (*--P == '#')
+      return true;
+  return false;
+}
 
-static ExprAST *ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+static bool KeywordAt(const char *Begin, const char *P, const char *E,
+                      const char *Keyword, size_t Len) {
+  return (size_t)(E - P) >= Len && !memcmp(P, Keyword, Len) &&
+         (P == Begin || !IsAlnum(P[-1])) && (P + Len == E || !IsAlnum(P[Len]));
+}
 
-  getNextToken();
+// Returns the first 'def' or 'extern' at or after P that is a whole word
+// outside a comment, or E. Keywords cannot appear inside an expression,
+// so in well-formed input every such position starts a top-level item at
+// nesting depth zero.
+static const char *NextItemStart(const char *Begin, const char *P, const char *E) {
+  for (; P != E; ++P) {
+    if ((KeywordAt(Begin, P, E, "def", 3) || KeywordAt(Begin, P, E, "extern", 6)) &&
+        !InComment(Begin, P))
+      return P;
+  }
+  return E;
+}
 
-  if (CurTok != '(')
-    return new VariableExprAST(IdName);
+struct ParseChunk {
+  SourceBuffer Src;
+  Lexer Lex;
+  Parser TheParser;
+  std::vector<TopLevelItem> Items;
 
-  getNextToken();
+  ParseChunk(const char *Begin, const char *End)
+    : Lex(Src), TheParser(Lex) {
+    Src.openMemory(Begin, End - Begin);
+  }
 
-  std::vector<ExprAST*> Args;
-  if (CurTok != ')') {
+  void parse() {
+    TheParser.getNextToken();
     while (1) {
-      ExprAST *Arg = ParseExpression();
-      if (!Arg) return 0;
-      Args.push_back(Arg);
+      while (TheParser.getCurTok() == ';')
+        TheParser.getNextToken();
+      if (TheParser.getCurTok() == tok_eof)
+        break;
+
+      Items.push_back(TopLevelItem());
+      ErrorLog = &Items.back().Errors;
+      ParseTopLevelItem(TheParser, Items.back());
+      ErrorLog = 0;
+    }
+  }
+};
 
-      if (CurTok == ')') break;
+struct ParsePool {
+  std::vector<ParseChunk*> Chunks;
+  volatile unsigned NextChunk;
+};
 
-      if (CurTok != ',')
-        return Error("Expected ')' or ',' in argument list");
-      getNextToken();
+static void *ParseWorker(void *Arg) {
+  ParsePool &Pool = *(ParsePool*)Arg;
+  while (1) {
+    unsigned i = __sync_fetch_and_add(&Pool.NextChunk, 1);
+    if (i >= Pool.Chunks.size())
+      return 0;
+    Pool.Chunks[i]->parse();
+  }
+}
+
+// Batch compilation (-j N -batch). After the parallel parse, a serial pass
+// in source order checks every definition and declares it in the main
+// module, as -tiered does. The checked bodies are then split into N
+// contiguous ranges of about equal size. Each worker generates and
+// optimizes its range in a private LLVMContext and module, and writes it
+// out as bitcode. The main thread reads the results into its own context
+// and links them in range order, so the module is the same whatever N is.
+// Machine code is still generated by the JIT on the main thread, the
+// first time a top-level expression calls into it.
+static bool BatchCompile = false;
+
+struct CompileRange {
+  std::vector<DeferredBody*> Bodies;
+  const TargetData *TD;
+  std::string Bitcode;
+};
+
+static void *CompileWorker(void *Arg) {
+  CompileRange &Range = *(CompileRange*)Arg;
+  LLVMContext Context;
+  BatchWorker = true;
+  ScratchModule Scratch(Context, *Range.TD);
+  for (unsigned i = 0, e = Range.Bodies.size(); i != e; ++i)
+    Scratch.compile(Range.Bodies[i]->Proto, Range.Bodies[i]->Body);
+
+  raw_string_ostream OS(Range.Bitcode);
+  WriteBitcodeToFile(Scratch.getModule(), OS);
+  OS.flush();
+  return 0;
+}
+
+static void CompileBatch(std::vector<ParseChunk*> &Chunks, unsigned Threads) {
+  double Start = Now();
+  std::vector<DeferredBody*> Bodies;
+  std::vector<TopLevelItem*> Exprs;
+  size_t Nodes = 0;
+  for (unsigned i = 0, e = Chunks.size(); i != e; ++i)
+    for (unsigned j = 0, je = Chunks[i]->Items.size(); j != je; ++j) {
+      TopLevelItem &Item = Chunks[i]->Items[j];
+      if (Item.Kind == tok_extern) {
+        CodegenTopLevelItem(Item);
+        continue;
+      }
+
+      fputs(Item.Errors.c_str(), stderr);
+      Item.Errors.clear();
+      if (Item.Func == 0)
+        continue;
+      if (Item.Kind == tok_def) {
+        if (DeferredBody *D = DeferParsedDefinition(Item.Func)) {
+          Bodies.push_back(D);
+          Nodes += D->Body->Nodes.size();
+        }
+      } else {
+        const ExprAST *Body = Item.Func->getBody();
+        if (CheckExpr(ASTOptimize ? *TheOptimizer.run(*Body) : *Body))
+          Exprs.push_back(&Item);
+      }
     }
+
+  double Checked = Now();
+  std::vector<CompileRange> Ranges(Threads);
+  size_t Filled = 0;
+  for (unsigned i = 0, r = 0, e = Bodies.size(); i != e; ++i) {
+    Ranges[r].Bodies.push_back(Bodies[i]);
+    Filled += Bodies[i]->Body->Nodes.size();
+    if (Filled * Threads >= Nodes * (r + 1) && r + 1 != Threads)
+      ++r;
   }
 
-  getNextToken();
+  llvm_start_multithreaded();
+  std::vector<pthread_t> Workers(Threads);
+  for (unsigned i = 0; i != Threads; ++i) {
+    Ranges[i].TD = TheExecutionEngine->getTargetData();
+    pthread_create(&Workers[i], 0, CompileWorker, &Ranges[i]);
+  }
+  for (unsigned i = 0; i != Threads; ++i)
+    pthread_join(Workers[i], 0);
+
+  double Generated = Now();
+  for (unsigned i = 0; i != Threads; ++i) {
+    MemoryBuffer *Buffer = MemoryBuffer::getMemBuffer(Ranges[i].Bitcode);
+    std::string ErrStr;
+    Module *M = ParseBitcodeFile(Buffer, getGlobalContext(), &ErrStr);
+    if (!M || Linker::LinkModules(TheModule, M, Linker::DestroySource, &ErrStr))
+      fprintf(stderr, "Error: could not link batch %u: %s\n", i, ErrStr.c_str());
+    delete M;
+    delete Buffer;
+  }
 
-  return new CallExprAST(IdName, Args);
+  // Linking replaced the declarations, and every body is now compiled.
+  Callees->clear();
+  DeferredBodies.clear();
+  for (Module::iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I)
+    if (!I->isDeclaration())
+      AddPendingInline(I);
+  double Linked = Now();
+
+  for (unsigned i = 0, e = Exprs.size(); i != e; ++i)
+    CodegenTopLevelItem(*Exprs[i]);
+
+  if (ShowStats)
+    fprintf(stderr, "Batch: %lu definitions on %u threads, checked in %.3f s, "
+            "generated in %.3f s, linked in %.3f s\n",
+            (unsigned long)Bodies.size(), Threads, Checked - Start,
+            Generated - Checked, Linked - Generated);
 }
 
-static ExprAST *ParseNumberExpr() {
-  ExprAST *Result = new NumberExprAST(NumVal);
-  getNextToken();
-  return Result;
+// Splits the buffer at top-level item boundaries, parses the pieces on
+// Threads worker threads, then generates code for every item in source
+// order on the calling thread, or with -batch on the threads again.
+static void ParallelParse(const char *Begin, const char *End, unsigned Threads) {
+  double Start = Now();
+
+  ParsePool Pool;
+  Pool.NextChunk = 0;
+  size_t ChunkSize = (End - Begin) / (Threads * 8) + 1;
+  const char *ChunkBegin = Begin;
+  while (ChunkBegin != End) {
+    const char *Split = End;
+    if ((size_t)(End - ChunkBegin) > ChunkSize)
+      Split = NextItemStart(Begin, ChunkBegin + ChunkSize, End);
+    Pool.Chunks.push_back(new ParseChunk(ChunkBegin, Split));
+    ChunkBegin = Split;
+  }
+
+  std::vector<pthread_t> Workers(Threads);
+  for (unsigned i = 0; i != Threads; ++i)
+    pthread_create(&Workers[i], 0, ParseWorker, &Pool);
+  for (unsigned i = 0; i != Threads; ++i)
+    pthread_join(Workers[i], 0);
+
+  double Parsed = Now();
+  if (BatchCompile)
+    CompileBatch(Pool.Chunks, Threads);
+  unsigned long Items = 0;
+  for (unsigned i = 0, e = Pool.Chunks.size(); i != e; ++i) {
+    ParseChunk *C = Pool.Chunks[i];
+    if (!BatchCompile)
+      for (unsigned j = 0, je = C->Items.size(); j != je; ++j)
+        CodegenTopLevelItem(C->Items[j]);
+    Items += C->Items.size();
+    delete C;
+  }
+
+  if (ShowStats)
+    fprintf(stderr, "Parsed %lu items in %lu chunks on %u threads in %.3f s, "
+            "codegen %.3f s\n", Items, (unsigned long)Pool.Chunks.size(),
+            Threads, Parsed - Start, Now() - Parsed);
 }
 
-static ExprAST *ParseParenExpr() {
-  getNextToken();
-  ExprAST *V = ParseExpression();
-  if (!V) return 0;
+// Incremental mode reads successive revisions of a whole buffer separated
+// by form feeds. Each top-level item is cached under a hash of its text;
+// items that are unchanged since the previous revision keep their code in
+// the module, and only new or edited items are parsed and generated.
+struct CachedFunction {
+  int Kind;
+  Symbol Name;
+  Function *F;
+};
 
-  if (CurTok != ')')
-    return Error("expected ')'");
-  getNextToken();
-  return V;
+struct CachedItem {
+  std::string Text;
+  unsigned Hash;
+  bool Failed, Matched;
+  std::vector<CachedFunction> Functions;
+};
+
+static std::vector<CachedItem*> CachedItems;
+static std::vector<unsigned> NameRefs;
+// Retired definitions whose declarations stay only for unchanged callers.
+static std::vector<Symbol> LingeringDecls;
+
+static bool ReadRevision(SourceBuffer &Src, std::string &Text) {
+  Text.clear();
+  while (1) {
+    if (Src.Cur == Src.End && !Src.fill())
+      return !Text.empty();
+    const char *FF = (const char*)memchr(Src.Cur, '\f', Src.End - Src.Cur);
+    Text.append(Src.Cur, FF ? FF : Src.End);
+    Src.Cur = FF ? FF + 1 : Src.End;
+    if (FF)
+      return true;
+  }
 }
 
-static ExprAST *ParsePrimary() {
-  switch (CurTok) {
-  default: return Error("unknown token when expecting an expression");
-  case tok_identifier: return ParseIdentifierExpr();
-  case tok_number:     return ParseNumberExpr();
-  case '(':            return ParseParenExpr();
+static const char *SkipBlanks(const char *P, const char *E) {
+  while (P != E) {
+    if (*P == '#')
+      while (P != E && *P != '\n' && *P != '\r') ++P;
+    else if (IsSpace(*P) || *P == ';')
+      ++P;
+    else
+      break;
   }
+  return P;
 }
 
-static ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
-  while (1) {
-    int TokPrec = GetTokPrecedence();
+// Returns the end of the item starting at P: just past its ';', or the
+// next 'def' or 'extern' keyword outside a comment.
+static const char *ItemEnd(const char *Begin, const char *P, const char *E) {
+  for (const char *Start = P; P != E; ++P) {
+    if (*P == '#') {
+      while (P + 1 != E && P[1] != '\n' && P[1] != '\r') ++P;
+    } else if (*P == ';') {
+      return P + 1;
+    } else if (P != Start && (KeywordAt(Begin, P, E, "def", 3) ||
+                              KeywordAt(Begin, P, E, "extern", 6))) {
+      while (IsSpace(P[-1])) --P;
+      return P;
+    }
+  }
+  return E;
+}
 
-    if (TokPrec < ExprPrec)
-      return LHS;
+// Drops the bodies of everything the retired items defined, then erases
+// the functions nothing refers to any more. Deleting all bodies first
+// releases the calls between retired items, so a function whose callers
+// were edited along with it does not linger as a declaration.
+static void RetireItems(const std::vector<CachedItem*> &Retired) {
+  std::vector<CachedFunction> Unreferenced;
+  for (unsigned r = 0, re = Retired.size(); r != re; ++r) {
+    const CachedItem &Item = *Retired[r];
+    for (unsigned i = 0, e = Item.Functions.size(); i != e; ++i) {
+      CachedFunction C = Item.Functions[i];
+      if (C.Kind == tok_def || C.Kind == tok_extern) {
+        C.F = Callees->lookup(C.Name);
+        if (C.F == 0) continue;
+        if (--NameRefs[C.Name] != 0) {
+          if (C.Kind == tok_def) C.F->deleteBody();
+          continue;
+        }
+      }
+      if (!C.F->empty())
+        C.F->deleteBody();
+      Unreferenced.push_back(C);
+    }
+  }
 
-    int BinOp = CurTok;
+  for (unsigned i = 0, e = Unreferenced.size(); i != e; ++i) {
+    const CachedFunction &C = Unreferenced[i];
+    Function *F = C.Kind ? Callees->lookup(C.Name) : C.F;
+    if (F == C.F && F->use_empty())
+      EraseFunction(F, C.Kind ? C.Name : SymAnon);
+    else if (F == C.F && C.Kind)
+      LingeringDecls.push_back(C.Name);
+  }
 
-    getNextToken();
+  // Erase the declarations whose last callers have now been retired too,
+  // so the name can be defined again with a different arity.
+  for (unsigned i = 0; i != LingeringDecls.size(); ) {
+    Symbol Name = LingeringDecls[i];
+    Function *F = NameRefs[Name] ? 0 : Callees->lookup(Name);
+    if (F && !F->use_empty()) {
+      ++i;
+      continue;
+    }
+    if (F)
+      EraseFunction(F, Name);
+    LingeringDecls.erase(LingeringDecls.begin() + i);
+  }
+}
 
-    ExprAST *RHS = ParsePrimary();
-    if (!RHS) return 0;
+static CachedItem *CompileItem(const char *Begin, const char *End, unsigned Hash) {
+  CachedItem *Item = new CachedItem();
+  Item->Text.assign(Begin, End);
+  Item->Hash = Hash;
+  Item->Failed = false;
+  Item->Matched = false;
+
+  ParseChunk Chunk(Item->Text.data(), Item->Text.data() + Item->Text.size());
+  Chunk.parse();
+  for (unsigned i = 0, e = Chunk.Items.size(); i != e; ++i) {
+    const TopLevelItem &TLI = Chunk.Items[i];
+    Function *F = CodegenTopLevelItem(TLI);
+    if (F == 0) {
+      Item->Failed = true;
+      continue;
+    }
 
-    int NextPrec = GetTokPrecedence();
-    if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec+1, RHS);
-      if (RHS == 0) return 0;
+    CachedFunction C;
+    C.Kind = TLI.Kind == tok_def || TLI.Kind == tok_extern ? TLI.Kind : 0;
+    C.Name = C.Kind ? (TLI.Func ? TLI.Func->getProto()->getName()
+                                : TLI.Proto->getName()) : 0;
+    C.F = F;
+    if (C.Kind) {
+      if (NameRefs.size() <= C.Name)
+        NameRefs.resize(C.Name + 1);
+      ++NameRefs[C.Name];
     }
+    Item->Functions.push_back(C);
+  }
+  return Item;
+}
 
-    LHS = new BinaryExprAST(BinOp, LHS, RHS);
+// Collects the top-level expressions that call one of the Changed
+// definitions, directly or through other functions, by following the
+// callers up the use lists.
+static void FindAffectedExprs(const std::vector<Symbol> &Changed,
+                              std::vector<Function*> &Exprs) {
+  SmallPtrSet<Function*, 16> Seen;
+  std::vector<Function*> Work;
+  for (unsigned i = 0, e = Changed.size(); i != e; ++i)
+    if (Function *F = Callees->lookup(Changed[i]))
+      if (Seen.insert(F))
+        Work.push_back(F);
+
+  while (!Work.empty()) {
+    Function *F = Work.back();
+    Work.pop_back();
+    for (Value::use_iterator U = F->use_begin(), UE = F->use_end(); U != UE; ++U) {
+      Instruction *I = dyn_cast<Instruction>(*U);
+      if (I == 0) continue;
+      Function *Caller = I->getParent()->getParent();
+      if (!Seen.insert(Caller)) continue;
+      if (Caller->getName().empty())
+        Exprs.push_back(Caller);
+      else
+        Work.push_back(Caller);
+    }
   }
+  std::sort(Exprs.begin(), Exprs.end());
 }
 
-static ExprAST *ParseExpression() {
-  ExprAST *LHS = ParsePrimary();
-  if (!LHS) return 0;
+static void AddDefinedNames(const CachedItem &Item, std::vector<Symbol> &Names) {
+  for (unsigned i = 0, e = Item.Functions.size(); i != e; ++i)
+    if (Item.Functions[i].Kind == tok_def)
+      Names.push_back(Item.Functions[i].Name);
+}
 
-  return ParseBinOpRHS(0, LHS);
+static bool LessHash(const CachedItem *L, const CachedItem *R) {
+  return L->Hash < R->Hash;
 }
 
-static PrototypeAST *ParsePrototype() {
-  if (CurTok != tok_identifier)
-    return ErrorP("Expected function name in prototype");
+static void HandleRevision(const std::string &Text, unsigned Revision) {
+  double Start = Now();
+  const char *Begin = Text.data(), *End = Begin + Text.size();
+
+  std::vector<const char*> Bounds;
+  std::vector<unsigned> Hashes;
+  for (const char *P = SkipBlanks(Begin, End); P != End;
+       P = SkipBlanks(Bounds.back(), End)) {
+    Bounds.push_back(P);
+    Bounds.push_back(ItemEnd(Begin, P, End));
+    Hashes.push_back(SymbolTable::hash(P, Bounds.back() - P));
+  }
 
-  std::string FnName = IdentifierStr;
-  getNextToken();
+  // Match the new items against the previous revision's by text.
+  std::vector<CachedItem*> Old(CachedItems);
+  std::sort(Old.begin(), Old.end(), LessHash);
+  std::vector<CachedItem*> Items(Hashes.size());
+  CachedItem Key;
+  for (unsigned i = 0, e = Hashes.size(); i != e; ++i) {
+    Key.Hash = Hashes[i];
+    std::vector<CachedItem*>::iterator I =
+      std::lower_bound(Old.begin(), Old.end(), &Key, LessHash);
+    size_t Len = Bounds[2*i+1] - Bounds[2*i];
+    for (; I != Old.end() && (*I)->Hash == Hashes[i]; ++I)
+      if (!(*I)->Matched && !(*I)->Failed && (*I)->Text.size() == Len &&
+          !memcmp((*I)->Text.data(), Bounds[2*i], Len)) {
+        (*I)->Matched = true;
+        Items[i] = *I;
+        break;
+      }
+  }
 
-  if (CurTok != '(')
-    return ErrorP("Expected '(' in prototype");
+  std::vector<CachedItem*> Retired;
+  std::vector<Symbol> Changed;
+  for (unsigned i = 0, e = CachedItems.size(); i != e; ++i) {
+    if (CachedItems[i]->Matched) {
+      CachedItems[i]->Matched = false;
+    } else {
+      Retired.push_back(CachedItems[i]);
+      AddDefinedNames(*CachedItems[i], Changed);
+    }
+  }
+  RetireItems(Retired);
+  for (unsigned i = 0, e = Retired.size(); i != e; ++i)
+    delete Retired[i];
+
+  unsigned Compiled = 0;
+  std::vector<bool> Fresh(Items.size());
+  for (unsigned i = 0, e = Items.size(); i != e; ++i)
+    if (Items[i] == 0) {
+      Items[i] = CompileItem(Bounds[2*i], Bounds[2*i+1], Hashes[i]);
+      AddDefinedNames(*Items[i], Changed);
+      Fresh[i] = true;
+      ++Compiled;
+    }
+  CachedItems.swap(Items);
+
+  // An unchanged expression still has to be run again when something it
+  // calls was edited or removed, once every new definition is in place.
+  // A definition removed without a replacement leaves its callers with
+  // nothing to call, so expressions reaching it are reported instead.
+  std::vector<Symbol> Removed;
+  for (unsigned i = 0, e = Changed.size(); i != e; ++i) {
+    Function *F = Callees->lookup(Changed[i]);
+    if (F && F->empty() && NameRefs[Changed[i]] == 0)
+      Removed.push_back(Changed[i]);
+  }
+  std::vector<Function*> Affected, Broken;
+  FindAffectedExprs(Changed, Affected);
+  FindAffectedExprs(Removed, Broken);
+  unsigned Rerun = 0;
+  for (unsigned i = 0, e = CachedItems.size(); i != e && !Affected.empty(); ++i) {
+    if (Fresh[i]) continue;
+    const std::vector<CachedFunction> &Functions = CachedItems[i]->Functions;
+    for (unsigned j = 0, je = Functions.size(); j != je; ++j) {
+      Function *F = Functions[j].F;
+      if (Functions[j].Kind != 0 ||
+          !std::binary_search(Affected.begin(), Affected.end(), F))
+        continue;
+      if (std::binary_search(Broken.begin(), Broken.end(), F)) {
+        Error("expression calls a function that was removed");
+        continue;
+      }
+      ReportResult(RunExpr(F));
+      ++Rerun;
+    }
+  }
 
-  std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
-    ArgNames.push_back(IdentifierStr);
-  if (CurTok != ')')
-    return ErrorP("Expected ')' in prototype");
+  if (ShowStats)
+    fprintf(stderr, "Revision %u: %lu items, %u compiled, %u retired, %u re-run in %.3f ms\n",
+            Revision, (unsigned long)CachedItems.size(), Compiled,
+            (unsigned)Retired.size(), Rerun,
+            (Now() - Start) * 1000);
+}
 
-  getNextToken();
+static void PrintCodegenStats() {
+  if (LazyDefinitions)
+    fprintf(stderr, "Lazy: %lu definitions deferred, %lu compiled\n",
+            NumDeferred, NumCompiledLazily);
+  if (Tiered)
+    fprintf(stderr, "Tiers: interpreter %lu calls in %.3f ms, native %lu entries in %.3f ms, "
+            "%lu promotions in %.3f ms\n",
+            NumInterpreted, InterpretSeconds * 1000, NumNativeEntries,
+            NativeSeconds * 1000, NumPromotions, PromoteSeconds * 1000);
+  if (TheInlineFPM)
+    fprintf(stderr, "Inliner: %lu calls inlined\n", NumInlinedCalls);
+  if (ASTOptimize)
+    fprintf(stderr, "AST optimizer: %lu nodes simplified, %lu call arguments pruned\n",
+            NumSimplified, NumPrunedArgs);
+  if (CacheDir)
+    fprintf(stderr, "Code cache: %lu hits, %lu misses, %lu evicted, %.1f of %.1f MB\n",
+            NumCacheHits, NumCacheMisses, NumCacheEvictions,
+            CacheBytes / 1048576.0, CacheLimit / 1048576.0);
+}
 
-  return new PrototypeAST(FnName, ArgNames);
+static void IncrementalLoop(SourceBuffer &Src) {
+  std::string Text;
+  for (unsigned Revision = 1; ReadRevision(Src, Text); ++Revision)
+    HandleRevision(Text, Revision);
 }
 
-static FunctionAST *ParseDefinition() {
-  getNextToken();
-  PrototypeAST *Proto = ParsePrototype();
-  if (Proto == 0) return 0;
+static double UnresolvedExternal() { return 0; }
 
-  if (ExprAST *E = ParseExpression())
-    return new FunctionAST(Proto, E);
-  return 0;
+static void *ResolveMissingFunction(const std::string &Name) {
+  fprintf(stderr, "Error: unresolved external '%s', calls return 0\n", Name.c_str());
+  return (void*)(intptr_t)UnresolvedExternal;
 }
 
-static FunctionAST *ParseTopLevelExpr() {
-  if (ExprAST *E = ParseExpression()) {
-    PrototypeAST *Proto = new PrototypeAST("", std::vector<std::string>());
-    return new FunctionAST(Proto, E);
+// Function passes run on every body as it is generated.
+static FunctionPassManager *CreateFunctionPasses(Module *M, const TargetData &TD) {
+  FunctionPassManager *FPM = new FunctionPassManager(M);
+  FPM->add(new TargetData(TD));
+  if (OptLevel >= 1) {
+    FPM->add(createBasicAliasAnalysisPass());
+    FPM->add(createPromoteMemoryToRegisterPass());
+    FPM->add(createInstructionCombiningPass());
+    FPM->add(createReassociatePass());
   }
-  return 0;
+  // At every level, so that self-recursion runs as a loop in constant
+  // stack space.
+  FPM->add(createTailCallEliminationPass());
+  if (OptLevel >= 2)
+    FPM->add(createGVNPass());
+  if (OptLevel >= 3) {
+    FPM->add(createLoopRotatePass());
+    FPM->add(createLICMPass());
+    FPM->add(createIndVarSimplifyPass());
+    FPM->add(createLoopUnrollPass());
+    FPM->add(createInstructionCombiningPass());
+  }
+  if (OptLevel >= 1)
+    FPM->add(createCFGSimplificationPass());
+  FPM->doInitialization();
+  return FPM;
 }
 
-static PrototypeAST *ParseExtern() {
-  getNextToken();
-  return ParsePrototype();
+// At -O2 and above calls are also inlined across functions, with the
+// thresholds of the stock inliner, and the functions that changed are
+// cleaned up by a second function pipeline.
+static void CreatePassPipelines(bool AllowInlining) {
+  const TargetData &TD = *TheExecutionEngine->getTargetData();
+  TheFPM = CreateFunctionPasses(TheModule, TD);
+
+  TheInlineFPM = 0;
+  if (OptLevel < 2 || !AllowInlining)
+    return;
+  InlineThreshold = OptLevel >= 3 ? 275 : 225;
+  TheInlineCost.setTargetData(&TD);
+  TheInlineFPM = new FunctionPassManager(TheModule);
+  TheInlineFPM->add(new TargetData(TD));
+  TheInlineFPM->add(createBasicAliasAnalysisPass());
+  TheInlineFPM->add(createInstructionCombiningPass());
+  TheInlineFPM->add(createReassociatePass());
+  TheInlineFPM->add(createGVNPass());
+  TheInlineFPM->add(createCFGSimplificationPass());
+  TheInlineFPM->doInitialization();
 }
 
-static Module *TheModule;
-static IRBuilder<> Builder(getGlobalContext());
-static std::map<std::string, Value*> NamedValues;
+static const CodeGenOpt::Level CodeGenLevels[] = {
+  CodeGenOpt::None, CodeGenOpt::Less, CodeGenOpt::Default, CodeGenOpt::Aggressive
+};
 
-Value *ErrorV(const char *Str) { Error(Str); return 0; }
+static bool CreateEngine(bool AllowInlining) {
+  TheModule = new Module("Pon JIT", getGlobalContext());
+  std::string ErrStr;
+  TheExecutionEngine = EngineBuilder(TheModule).setErrorStr(&ErrStr)
+                         .setOptLevel(CodeGenLevels[OptLevel]).create();
+  if (!TheExecutionEngine) {
+    fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
+    return false;
+  }
+  TheExecutionEngine->InstallLazyFunctionCreator(ResolveMissingFunction);
+  CreatePassPipelines(AllowInlining);
+  return true;
+}
 
-Value *NumberExprAST::Codegen() {
-  return ConstantFP::get(getGlobalContext(), APFloat(Val));
+static void DestroyEngine() {
+  delete TheInlineFPM;
+  delete TheFPM;
+  delete TheExecutionEngine;
+  TheInlineFPM = 0;
+  PendingInline.clear();
+  TheInlineCost.clear();
+  TheFPM = 0;
+  TheExecutionEngine = 0;
+  TheModule = 0;
+  Callees->clear();
 }
 
-Value *VariableExprAST::Codegen() {
-  Value *V = NamedValues[Name];
-  return V ? V : ErrorV("Unknown variable name");
+// Compiles the same generated program at each optimization level and
+// reports the time spent generating, optimizing and JIT-compiling it
+// against the time taken to run it.
+static bool BenchOpt(unsigned Depth, unsigned Calls) {
+  std::string Source =
+    "def poly(x) x*x*x + 3*x*x + x*x*x + 3*x*x + (x+0)*1;\n"
+    "def f0(x) poly(x) + poly(x+1);\n";
+  char Line[128];
+  for (unsigned i = 1; i <= Depth; ++i) {
+    sprintf(Line, "def f%u(x) f%u(x)*0.5 + f%u(x+1)*0.25 + x*x + x*x;\n", i, i-1, i-1);
+    Source += Line;
+  }
+  sprintf(Line, "def entry(x) f%u(x);\n", Depth);
+  Source += Line;
+
+  unsigned SavedLevel = OptLevel;
+  for (OptLevel = 0; OptLevel <= 3; ++OptLevel) {
+    if (!CreateEngine(true))
+      return false;
+
+    double Start = Now();
+    SourceBuffer Src;
+    Src.openMemory(Source.data(), Source.size());
+    Lexer Lex(Src);
+    Parser TheParser(Lex);
+    TheParser.getNextToken();
+    while (TheParser.getCurTok() == tok_def) {
+      FunctionAST *F = TheParser.ParseDefinition();
+      if (!F || !F->Codegen())
+        return false;
+      while (TheParser.getCurTok() == ';')
+        TheParser.getNextToken();
+    }
+    InlinePending(0);
+    Function *EntryF = CreateCWrapper(TheModule->getFunction("entry"), "entry.c",
+                                      Function::InternalLinkage);
+    double (*Entry)(double) = (double (*)(double))(intptr_t)
+      TheExecutionEngine->getPointerToFunction(EntryF);
+    double Compiled = Now();
+
+    double Sum = 0;
+    for (unsigned i = 0; i != Calls; ++i)
+      Sum += Entry(i * 0.001);
+    double Ran = Now();
+
+    fprintf(stderr, "-O%u: compile %.3f ms, run %.3f ms (%.1f ns/call), checksum %g\n",
+            OptLevel, (Compiled - Start) * 1000, (Ran - Compiled) * 1000,
+            (Ran - Compiled) * 1e9 / Calls, Sum);
+    DestroyEngine();
+  }
+  OptLevel = SavedLevel;
+  return true;
 }
 
-Value *BinaryExprAST::Codegen() {
-  Value *L = LHS->Codegen();
-  Value *R = RHS->Codegen();
-  if (L == 0 || R == 0) return 0;
+// Ahead-of-time output (-aot NAME), for hosts that do not carry the JIT.
+// Once the whole file has run, the module is compiled by a TargetMachine
+// into NAME.o, which NAME.a also holds, and NAME.h declares its functions.
+// NAME_check.c calls the compiled copy of every top-level expression and
+// compares the result, bit for bit, with the one the JIT computed; a NaN
+// matches any NaN, as its sign and payload are left to the hardware.
+static bool IsCIdentifier(const std::string &Name) {
+  if (Name.empty() || isdigit((unsigned char)Name[0]))
+    return false;
+  for (unsigned i = 0, e = Name.size(); i != e; ++i)
+    if (!isalnum((unsigned char)Name[i]) && Name[i] != '_')
+      return false;
+  return true;
+}
 
-  switch (Op) {
-  case '+': return Builder.CreateFAdd(L, R, "addtmp");
-  case '-': return Builder.CreateFSub(L, R, "subtmp");
-  case '*': return Builder.CreateFMul(L, R, "multmp");
-  case '<':
-    L = Builder.CreateFCmpULT(L, R, "cmptmp");
-    return Builder.CreateUIToFP(L, Type::getDoubleTy(getGlobalContext()), "booltmp");
-  default: return ErrorV("invalid binary operator");
-  }
+static const char *BaseName(const char *Path) {
+  const char *Slash = strrchr(Path, '/');
+  return Slash ? Slash + 1 : Path;
 }
 
-Value *CallExprAST::Codegen() {
-  Function *CalleeF = TheModule->getFunction(Callee);
-  if (CalleeF == 0)
-    return ErrorV("Unknown function referenced");
+// NAME's file name with anything C would not accept replaced by '_'.
+static std::string CIdentifierFor(const char *Path) {
+  std::string Name = BaseName(Path);
+  for (unsigned i = 0, e = Name.size(); i != e; ++i)
+    if (!isalnum((unsigned char)Name[i]))
+      Name[i] = '_';
+  if (Name.empty() || isdigit((unsigned char)Name[0]))
+    Name = "_" + Name;
+  return Name;
+}
 
-  if (CalleeF->arg_size() != Args.size())
-    return ErrorV("Incorrect # arguments passed");
+static bool WriteFile(const std::string &Path, const std::string &Data) {
+  FILE *File = fopen(Path.c_str(), "wb");
+  bool Written = File && fwrite(Data.data(), 1, Data.size(), File) == Data.size();
+  if (File && fclose(File))
+    Written = false;
+  if (!Written)
+    fprintf(stderr, "Error: could not write '%s': %s\n", Path.c_str(), strerror(errno));
+  return Written;
+}
 
-  std::vector<Value*> ArgsV;
-  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->Codegen());
-    if (ArgsV.back() == 0) return 0;
-  }
+static void AppendArchiveHeader(std::string &Out, const std::string &Name, size_t Size) {
+  char Header[80];
+  sprintf(Header, "%-16s%-12d%-6d%-6d%-8o%-10lu`\n", Name.c_str(), 0, 0, 0, 0100644,
+          (unsigned long)Size);
+  Out += Header;
+}
 
-  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+static void AppendBigEndian32(std::string &Out, unsigned long Value) {
+  for (int Shift = 24; Shift >= 0; Shift -= 8)
+    Out += (char)((Value >> Shift) & 0xff);
 }
 
-Function *PrototypeAST::Codegen() {
-  std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(getGlobalContext()));
-  FunctionType *FT = FunctionType::get(Type::getDoubleTy(getGlobalContext()), Doubles, false);
+// A System V archive as GNU ld and gold read it: a symbol index ("/"),
+// then the object. The index holds the number of symbols, the offset of
+// the member defining each, and their names.
+static std::string BuildArchive(const std::string &Member, const std::string &Object,
+                                const std::vector<std::string> &Exported) {
+  std::string Names;
+  for (unsigned i = 0, e = Exported.size(); i != e; ++i)
+    Names.append(Exported[i].c_str(), Exported[i].size() + 1);
+  size_t IndexSize = 4 + 4 * Exported.size() + Names.size();
+  unsigned long MemberOffset = 8 + 60 + IndexSize + (IndexSize & 1);
+
+  std::string Out = "!<arch>\n";
+  AppendArchiveHeader(Out, "/", IndexSize);
+  AppendBigEndian32(Out, Exported.size());
+  for (unsigned i = 0, e = Exported.size(); i != e; ++i)
+    AppendBigEndian32(Out, MemberOffset);
+  Out += Names;
+  if (IndexSize & 1)
+    Out += '\n';
+
+  AppendArchiveHeader(Out, Member + "/", Object.size());
+  Out += Object;
+  if (Object.size() & 1)
+    Out += '\n';
+  return Out;
+}
 
-  Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule);
+static void AppendPrototype(std::string &Out, Function *F) {
+  Out += "double " + F->getName().str() + "(";
+  for (unsigned i = 0, e = F->arg_size(); i != e; ++i)
+    Out += i ? ", double" : "double";
+  Out += F->arg_size() ? ");\n" : "void);\n";
+}
 
-  if (F->getName() != Name) {
-    F->eraseFromParent();
-    F = TheModule->getFunction(Name);
+static bool EmitAOT() {
+  InlinePending(0);
 
-    if (!F->empty()) {
-      ErrorF("redefinition of function");
-      return 0;
-    }
+  std::string Triple = sys::getHostTriple(), ErrStr;
+  const Target *TheTarget = TargetRegistry::lookupTarget(Triple, ErrStr);
+  if (!TheTarget) {
+    fprintf(stderr, "Error: no target for '%s': %s\n", Triple.c_str(), ErrStr.c_str());
+    return false;
+  }
+  // Position-independent, so the archive can also be linked into a
+  // shared library.
+  TargetMachine *TM = TheTarget->createTargetMachine(Triple, sys::getHostCPUName(), "",
+                                                     Reloc::PIC_, CodeModel::Default);
+  TheModule->setTargetTriple(Triple);
+  TheModule->setDataLayout(TM->getTargetData()->getStringRepresentation());
+
+  // Hosts call the definitions through C symbols. Each body moves to an
+  // internal NAME.body, and a C wrapper exported as NAME calls it.
+  std::vector<Function*> Bodies;
+  for (Module::iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I)
+    if (!I->isDeclaration() && I->hasExternalLinkage() &&
+        I->getCallingConv() == CallingConv::Fast)
+      Bodies.push_back(I);
+  for (unsigned i = 0, e = Bodies.size(); i != e; ++i) {
+    std::string Name = Bodies[i]->getName().str();
+    Bodies[i]->setName(Name + ".body");
+    Bodies[i]->setLinkage(Function::InternalLinkage);
+    CreateCWrapper(Bodies[i], Name, Function::ExternalLinkage);
+  }
 
-    if (F->arg_size() != Args.size()) {
-      ErrorF("redefinition of function with different # args");
-      return 0;
+  // Collected before codegen, which may rewrite the IR.
+  std::vector<std::string> Exprs(AOTExprNames);
+  std::sort(Exprs.begin(), Exprs.end());
+  std::vector<std::string> Exported;
+  std::vector<Function*> Defined, Host;
+  const char *GlobalPrefix = TM->getMCAsmInfo()->getGlobalPrefix();
+  for (Module::iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I) {
+    Function *F = I;
+    std::string Name = F->getName().str();
+    if (Name.empty() || !F->hasExternalLinkage())
+      continue;
+    if (F->isDeclaration()) {
+      if (IsCIdentifier(Name))
+        Host.push_back(F);
+      continue;
     }
+    Exported.push_back(GlobalPrefix + Name);
+    if (IsCIdentifier(Name) && !std::binary_search(Exprs.begin(), Exprs.end(), Name))
+      Defined.push_back(F);
   }
 
-  unsigned Idx = 0;
-  for (Function::arg_iterator AI = F->arg_begin(); Idx != Args.size(); ++AI, ++Idx) {
-    AI->setName(Args[Idx]);
-    NamedValues[Args[Idx]] = AI;
+  double Start = Now();
+  std::string Object;
+  raw_string_ostream OS(Object);
+  {
+    formatted_raw_ostream FOS(OS);
+    PassManager PM;
+    PM.add(new TargetData(*TM->getTargetData()));
+    if (TM->addPassesToEmitFile(PM, FOS, TargetMachine::CGFT_ObjectFile,
+                                CodeGenLevels[OptLevel])) {
+      fprintf(stderr, "Error: %s cannot emit object files\n", Triple.c_str());
+      delete TM;
+      return false;
+    }
+    PM.run(*TheModule);
+  }
+  OS.flush();
+  delete TM;
+  double Emitted = Now();
+
+  std::string Base = AOTName, Guard = AOTPrefix + "_H";
+  for (unsigned i = 0, e = Guard.size(); i != e; ++i)
+    Guard[i] = toupper((unsigned char)Guard[i]);
+
+  std::string Header = "/* Generated by pon -aot. */\n"
+    "#ifndef " + Guard + "\n#define " + Guard + "\n\n"
+    "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+  for (unsigned i = 0, e = Defined.size(); i != e; ++i)
+    AppendPrototype(Header, Defined[i]);
+  if (!Host.empty()) {
+    Header += "\n/* Provided by the host. */\n";
+    for (unsigned i = 0, e = Host.size(); i != e; ++i)
+      AppendPrototype(Header, Host[i]);
   }
+  Header += "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+
+  std::string Check = "/* Generated by pon -aot: checks " + std::string(BaseName(AOTName)) +
+    ".a against the results the JIT computed. Build with\n"
+    "   cc " + BaseName(AOTName) + "_check.c " + BaseName(AOTName) + ".a -lm\n"
+    "   and whatever else provides the functions the header leaves to the host. */\n"
+    "#include <stdio.h>\n#include <string.h>\n"
+    "#include \"" + BaseName(AOTName) + ".h\"\n\n";
+  for (unsigned i = 0, e = AOTExprNames.size(); i != e; ++i)
+    Check += "double " + AOTExprNames[i] + "(void);\n";
+  Check += "\nstatic int Failed;\n\n"
+    "static void check(const char *Name, double Got, unsigned long long Expected) {\n"
+    "  double Want;\n"
+    "  memcpy(&Want, &Expected, sizeof Want);\n"
+    "  if (memcmp(&Got, &Want, sizeof Got) && (Got == Got || Want == Want)) {\n"
+    "    printf(\"%s: got %.17g, the JIT computed %.17g\\n\", Name, Got, Want);\n"
+    "    ++Failed;\n"
+    "  }\n"
+    "}\n\n"
+    "int main(void) {\n";
+  for (unsigned i = 0, e = AOTExprNames.size(); i != e; ++i) {
+    unsigned long long Bits;
+    memcpy(&Bits, &AOTExprValues[i], sizeof Bits);
+    char Line[256];
+    sprintf(Line, "  check(\"%s\", %s(), 0x%016llxULL); /* %.17g */\n",
+            AOTExprNames[i].c_str(), AOTExprNames[i].c_str(), Bits, AOTExprValues[i]);
+    Check += Line;
+  }
+  char Summary[128];
+  sprintf(Summary, "  printf(\"%%d of %lu results match the JIT\\n\", %lu - Failed);\n",
+          (unsigned long)AOTExprNames.size(), (unsigned long)AOTExprNames.size());
+  Check += Summary;
+  Check += "  return Failed != 0;\n}\n";
+
+  // Archive member names are limited to 15 characters.
+  std::string Member = AOTPrefix.size() <= 13 ? AOTPrefix + ".o" : "pon.o";
+  if (!WriteFile(Base + ".o", Object) ||
+      !WriteFile(Base + ".a", BuildArchive(Member, Object, Exported)) ||
+      !WriteFile(Base + ".h", Header) ||
+      !WriteFile(Base + "_check.c", Check))
+    return false;
+
+  fprintf(stderr, "Wrote %s.o, %s.a, %s.h and %s_check.c: %lu functions, "
+          "%lu top-level expressions, %lu bytes of code in %.3f s\n",
+          AOTName, AOTName, AOTName, AOTName, (unsigned long)Defined.size(),
+          (unsigned long)AOTExprNames.size(), (unsigned long)Object.size(),
+          Emitted - Start);
+  return true;
+}
 
-  return F;
+extern "C"
+double putchard(double X) {
+  putchar((char)X);
+  return 0;
 }
 
-Function *FunctionAST::Codegen() {
-  NamedValues.clear();
+int main(int argc, char **argv) {
+  StartTime = Now();
+  bool LexMode = false, BenchLexMode = false, BenchNumMode = false;
+  bool ForceScalar = false, PreTokenize = false, Incremental = false;
+  bool BenchOptMode = false;
+  unsigned BenchParseOperands = 0, StressNesting = 0, ParseThreads = 0;
+  unsigned BenchCallSites = 0;
+  const char *Path = 0;
+  for (int i = 1; i != argc; ++i) {
+    if (!strcmp(argv[i], "-lex"))
+      LexMode = true;
+    else if (!strcmp(argv[i], "-bench-lex"))
+      BenchLexMode = true;
+    else if (!strcmp(argv[i], "-bench-num"))
+      BenchNumMode = true;
+    else if (!strcmp(argv[i], "-bench-parse") && i + 1 != argc)
+      BenchParseOperands = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-stress-depth") && i + 1 != argc)
+      StressNesting = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-bench-codegen") && i + 1 != argc)
+      BenchCallSites = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-bench-opt"))
+      BenchOptMode = true;
+    else if (argv[i][0] == '-' && argv[i][1] == 'O' &&
+             argv[i][2] >= '0' && argv[i][2] <= '3' && !argv[i][3])
+      OptLevel = argv[i][2] - '0';
+    else if (!strcmp(argv[i], "-j") && i + 1 != argc)
+      ParseThreads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-batch"))
+      BatchCompile = true;
+    else if (!strcmp(argv[i], "-aot") && i + 1 != argc)
+      AOTName = argv[++i];
+    else if (!strcmp(argv[i], "-cache") && i + 1 != argc)
+      CacheDir = argv[++i];
+    else if (!strcmp(argv[i], "-cache-limit") && i + 1 != argc)
+      CacheLimit = strtoul(argv[++i], 0, 10) << 20;
+    else if (!strcmp(argv[i], "-hashcons"))
+      HashConsing = HashConsPure;
+    else if (!strcmp(argv[i], "-hashcons-calls"))
+      HashConsing = HashConsCalls;
+    else if (!strcmp(argv[i], "-incremental"))
+      Incremental = true;
+    else if (!strcmp(argv[i], "-ast-opt"))
+      ASTOptimize = true;
+    else if (!strcmp(argv[i], "-fast-math"))
+      ASTOptimize = FastMath = true;
+    else if (!strcmp(argv[i], "-lazy"))
+      LazyDefinitions = true;
+    else if (!strcmp(argv[i], "-lazy-jit"))
+      LazyDefinitions = LazyJIT = true;
+    else if (!strcmp(argv[i], "-tiered") && i + 1 != argc) {
+      Tiered = true;
+      TierThreshold = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-tokens"))
+      PreTokenize = true;
+    else if (!strcmp(argv[i], "-stats"))
+      ShowStats = true;
+    else if (!strcmp(argv[i], "-scalar"))
+      ForceScalar = true;
+    else
+      Path = argv[i];
+  }
 
-  Function *TheFunction = Proto->Codegen();
-  if (TheFunction == 0)
+  if (BenchParseOperands > 1) {
+    BenchParse(BenchParseOperands);
     return 0;
-
-  BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry", TheFunction);
-  Builder.SetInsertPoint(BB);
-
-  if (Value *RetVal = Body->Codegen()) {
-    Builder.CreateRet(RetVal);
-    verifyFunction(*TheFunction);
-
-    return TheFunction;
   }
 
-  TheFunction->eraseFromParent();
-  return 0;
-}
-
-static void HandleDefinition() {
-  if (FunctionAST *F = ParseDefinition()) {
-    if (Function *LF = F->Codegen()) {
-      fprintf(stderr, "Read function definition:");
-      LF->dump();
+  SourceBuffer Src;
+  if (Path) {
+    if (!Src.openFile(Path)) {
+      fprintf(stderr, "Error: could not open '%s'\n", Path);
+      return 1;
     }
   } else {
-    getNextToken();
+    Src.openStdin();
   }
-}
 
-static void HandleExtern() {
-  if (PrototypeAST *P = ParseExtern()) {
-    if (Function *F = P->Codegen()) {
-      fprintf(stderr, "Read extern: ");
-      F->dump();
+  DefaultScanner = ForceScalar ? &ScalarScanner : BestScanner();
+
+  if (BenchLexMode) {
+    if (!BenchLex(Src)) {
+      fprintf(stderr, "Error: -bench-lex needs a file argument\n");
+      return 1;
     }
-  } else {
-    getNextToken();
+    return 0;
   }
-}
 
-static void HandleTopLevelExpression() {
-  if (FunctionAST *F = ParseTopLevelExpr()) {
-    if (Function *LF = F->Codegen()) {
-      fprintf(stderr, "Read top-level expression:");
-      LF->dump();
+  if (BenchNumMode) {
+    if (!BenchNumbers(Src)) {
+      fprintf(stderr, "Error: -bench-num needs a file argument\n");
+      return 1;
     }
-  } else {
-    getNextToken();
+    return 0;
   }
-}
 
-static void MainLoop() {
-  while (1) {
-    fprintf(stderr, "pon> ");
-    switch (CurTok) {
-    case tok_eof:    return;
-    case ';':        getNextToken(); break;
-    case tok_def:    HandleDefinition(); break;
-    case tok_extern: HandleExtern(); break;
-    default:         HandleTopLevelExpression(); break;
+  if (LexMode) {
+    LexOnly(Src);
+    return 0;
+  }
+
+  InitializeNativeTarget();
+  GuaranteedTailCallOpt = true;
+#ifdef LLVM_NATIVE_ASMPRINTER
+  if (AOTName)
+    LLVM_NATIVE_ASMPRINTER();
+#endif
+
+  if (BenchOptMode)
+    return BenchOpt(10, 2000) ? 0 : 1;
+
+  // Batch compilation compiles every body up front, on its own threads.
+  if (BatchCompile) {
+    LazyDefinitions = LazyJIT = Tiered = false;
+    if (!ParseThreads)
+      ParseThreads = 1;
+  }
+
+  if (AOTName) {
+    if (Incremental) {
+      fprintf(stderr, "Error: -aot cannot be combined with -incremental\n");
+      return 1;
     }
+    // Every body has to be generated before the module is emitted.
+    LazyDefinitions = LazyJIT = Tiered = false;
+    AOTPrefix = CIdentifierFor(AOTName);
   }
-}
 
-extern "C"
-double putchard(double X) {
-  putchar((char)X);
-  return 0;
-}
+  // Inlining would copy bodies that incremental mode may later replace,
+  // and has nothing to work with while bodies are still deferred.
+  if (!CreateEngine(!Incremental && !LazyJIT && !Tiered))
+    return 1;
+  fprintf(stderr, "Optimization level: -O%u\n", OptLevel);
 
-int main() {
-  LLVMContext &Context = getGlobalContext();
+  if (CacheDir && !Incremental && !OpenCache())
+    return 1;
 
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40;
+  if ((LazyJIT || Tiered) && !Incremental) {
+    TheModule->setMaterializer(new DeferredBodyMaterializer());
+    TheExecutionEngine->DisableLazyCompilation(false);
+  }
 
-  fprintf(stderr, "pon> ");
-  getNextToken();
+  if (StressNesting)
+    return StressDepth(StressNesting) ? 0 : 1;
+
+  if (BenchCallSites)
+    return BenchCodegen(BenchCallSites) ? 0 : 1;
+
+  if (Incremental) {
+    // An edited callee may start reading a parameter its callers pruned.
+    LazyDefinitions = LazyJIT = Tiered = false;
+    PruneArguments = false;
+    KeepExprFunctions = true;
+    CacheDir = 0;
+    IncrementalLoop(Src);
+    TheModule->dump();
+    return 0;
+  }
 
-  TheModule = new Module("Pon JIT", Context);
+  if (ParseThreads) {
+    if (!Src.rewind()) {
+      fprintf(stderr, "Error: -j needs a file argument\n");
+      return 1;
+    }
+    ParallelParse(Src.Cur, Src.End, ParseThreads);
+    TheModule->dump();
+    if (ShowStats)
+      PrintCodegenStats();
+    return AOTName && !EmitAOT() ? 1 : 0;
+  }
+
+  Lexer Lex(Src);
+  TokenStream Tokens;
+  if (PreTokenize) {
+    double Start = Now();
+    Tokens.lex(Lex);
+    fprintf(stderr, "Pre-tokenized %u tokens into %lu bytes in %.3f s\n",
+            Tokens.size(), (unsigned long)Tokens.bytes(), Now() - Start);
+  }
+  Parser *TheParser = PreTokenize ? new Parser(Tokens) : new Parser(Lex);
 
-  MainLoop();
+  fprintf(stderr, "pon> ");
+  TheParser->getNextToken();
+
+  MainLoop(*TheParser);
 
   TheModule->dump();
+  if (AOTName && !EmitAOT())
+    return 1;
+
+  if (ShowStats) {
+    TheParser->printArenaStats();
+    PrintCodegenStats();
+  }
+  delete TheParser;
 
   return 0;
 }
 
-// clang++ -g -O3 pon.cpp `llvm-config --cppflags --ldflags --libs core` -o pon
-// clang++ -g -O3 pon.cpp -I/usr/local/include -D_DEBUG -D_GNU_SOURCE -D__STDC_CONSTANT_MACROS -D__STDC_FORMAT_MACROS -D__STDC_LIMIT_MACROS -L/usr/local/lib -lpthread -lm -lLLVMCore -lLLVMSupport -o pon
+// ./pon [-lex|-bench-lex|-bench-num|-bench-parse N|-bench-opt|-bench-codegen N|-stress-depth N] [-O0|-O1|-O2|-O3] [-j N [-batch]|-incremental] [-lazy|-lazy-jit|-tiered N] [-hashcons|-hashcons-calls] [-ast-opt] [-fast-math] [-cache DIR [-cache-limit MB]] [-aot NAME] [-tokens] [-stats] [-scalar] [file]
+// clang++ -g -O3 -rdynamic pon.cpp `llvm-config --cppflags --ldflags --libs core jit native bitreader bitwriter linker` -o pon
 
 // 4+5;
 // def foo(a b) a*a + 2*a*b + b*b;